@@ -160,7 +160,7 @@ int main(int argc, char* argv[]){
         strcat(requests[i], " ");
         num = rand() % topic_count;
         strncat(requests[i], messages[num], MAX_TOPIC_LEN);
-        strcat(requests[i], " new message\0");
+        strcat(requests[i], " new message\n"); //publishers split the stream on newlines
     }
     puts("Done crafting requests");
     while(1){
@@ -176,12 +176,12 @@ START_WHILE:
                 // goto EXIT;
                 // continue;
             }
-            //some buffering(?) causes requests to not be individual. This fixes(?) that
+            //requests are newline terminated, so TCP merging them is fine
             // usleep(100);
         }
         gettimeofday(&end, NULL);
         double delta = getdetlatimeofday(&begin, &end);
-        if(send(conn_fd,"stat stat",strlen("stat stat"),MSG_NOSIGNAL) < 0){
+        if(send(conn_fd,"stat stat\n",strlen("stat stat\n"),MSG_NOSIGNAL) < 0){
             dropped = 1;
             fprintf(stderr, "Error: Failed to send data. %s.\n", strerror(errno));
             goto START_WHILE;
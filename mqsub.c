@@ -0,0 +1,1667 @@
+// mqsub.c
+// subscriber library, see mqsub.h
+// subscribe to all publishers, broadcast topic on request
+// receives with io_uring
+#define _GNU_SOURCE // recvmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <liburing.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include "mqsub.h"
+
+#define RECV_BUFFERS 256 //provided receive buffers shared by every connection, power of 2
+#define RECV_BUFFER_SIZE 16384
+#define RECV_BGID 0 //buffer group id of the ring
+#define MAX_RECV_THREADS 64
+#define MAX_BATCH (RECV_BUFFER_SIZE / (sizeof(frame_hdr_t) + 1) + 1) // frames one receive buffer can hold
+#define MAX_CONNS 1024
+#define QUEUE_DEPTH 512
+#define SQPOLL_IDLE_MS 1000
+#define MAX_LOGS 64 // publisher logs we keep a resume position for
+#define SHM_READERS 64 // reader slots in a publisher's shared-memory ring
+#define SHM_MAGIC 0x6d717368
+#define SHM_BATCHES 64 // batches a ring reader may have lent out
+#define SHM_SPIN 2000 // empty polls before a ring reader sleeps
+#define SHM_SLEEP_NS 100000000 // futex wait, so a closed connection is noticed
+#define MCAST_SOURCES 64 // publisher multicast groups we read
+#define MCAST_SOCKETS 16 // group address:port pairs joined
+#define MCAST_BATCH 16 // datagrams per recvmmsg
+#define MCAST_DATAGRAM 4096 // largest datagram, one frame
+#define MCAST_BLOCKS 8 // recvmmsg blocks per group socket, lent out with their batch
+#define MCAST_RCVBUF (4 << 20)
+#define MCAST_MISSING 16 // seq ranges per group waiting for a repair
+#define MCAST_REPAIR_WAIT 2 // seconds before a repair is asked for again
+#define MCAST_REPAIR_TRIES 5 // requests before the messages count as lost
+#define MAX_TOPIC_LEN 64
+#define TOPIC_CAPACITY 16
+#define DEFAULT_PORT 5555
+#define MICROSERVICE_PORT 4444
+#define HEARTBEAT_PORT 5554
+#define HEARTBEAT_INTERVAL 1
+#define BROADCAST_IP "127.255.255.255"
+#define SYSTEM_ID 99
+
+#define TYPE_ACCEPT  0
+#define TYPE_READ  1
+#define TYPE_WAKE  2
+#define TYPE_CANCEL  3
+#define EV_DATA(type, fd) (((uint64_t)(type) << 32) | (uint32_t)(fd))
+
+// Heartbeat, subscriber -> publisher (UDP), same layout as the publisher.
+// HB_PING every HEARTBEAT_INTERVAL while nothing changes, HB_DELTA right
+// away when a topic is added or removed, HB_FULL at start and whenever a
+// publisher answers with HB_NAK. FULL and DELTA are followed by count
+// records: uint8 op (HB_ADD/HB_REMOVE), uint8 length, topic bytes.
+// FULL also carries an HB_RESUME record (uint32 log id, uint64 seq) per
+// publisher log we have seen, and one with log id 0 and a unix time in ms
+// when replay_ms asks for history from logs we have not seen.
+// flags has HB_F_SHM when we can read a same-host publisher's ring,
+// HB_F_MCAST when we join multicast groups. HB_REPAIR is the header and an
+// mcast_repair_t, asking for multicast messages we missed on the stream
+#define HB_VERSION 2
+#define HB_F_SHM 1
+#define HB_F_MCAST 2
+#define HB_MAX_SIZE 1472
+enum { HB_PING = 0, HB_FULL, HB_DELTA, HB_NAK, HB_REPAIR };
+enum { HB_ADD = 0, HB_REMOVE, HB_RESUME };
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;     // HB_VERSION
+    uint8_t type;        // HB_*
+    uint8_t policy;      // what the publisher does when we fall behind, BP_*
+    uint8_t count;       // topic records that follow
+    uint32_t system_id;
+    uint32_t epoch;      // topic list version, bumped on every change
+    uint32_t lag_limit;  // bytes we may fall behind, 0 for the publisher default
+    uint16_t advertised_port;
+    uint16_t flags;      // HB_F_*
+    uint64_t timestamp; // Time when the heartbeat was sent
+} heartbeat_t;
+
+// Stream framing, publisher -> subscriber. Each message on the TCP stream is
+// this header (network order), then a frame_seq_t if flags has FRAME_SEQ,
+// then topic_len topic bytes, then len payload bytes.
+// FRAME_SHM names the publisher's shared-memory ring (topic) and our reader
+// slot in it (uint32 payload), its messages come from the ring after that.
+// FRAME_MCAST moves the pattern it names to a multicast group (mcast_offer_t).
+// FRAME_REPAIR (the group's pattern, mcast_repaired_t) comes before the
+// frames of a repair
+#define FRAME_SEQ 1
+#define FRAME_SHM 2
+#define FRAME_MCAST 4
+#define FRAME_REPAIR 8
+typedef struct __attribute__((packed)) {
+    uint32_t len;        // payload length
+    uint16_t topic_len;
+    uint16_t flags;      // FRAME_*
+} frame_hdr_t;
+
+// a message from a publisher that logs, same layout as the publisher
+typedef struct __attribute__((packed)) {
+    uint64_t seq;
+    uint32_t log_id;
+    uint32_t topic_seq;
+} frame_seq_t;
+
+// multicast, same layouts as the publisher
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t reserved;
+    uint64_t seq;
+    uint64_t lvc_gen;
+} mcast_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t port;
+    uint32_t addr;
+    uint32_t iface;
+    uint64_t next_seq;
+    uint64_t lvc_gen;
+} mcast_offer_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t reserved;
+    uint64_t from;
+    uint64_t to;
+} mcast_repair_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t reserved;
+    uint64_t asked;
+    uint64_t kept;
+    uint64_t to;
+} mcast_repaired_t;
+
+// a publisher's shared-memory ring, same layout as the publisher
+typedef struct {
+    uint32_t size;     // record bytes, header included
+    uint32_t skip;     // filler to the end of the ring
+    uint64_t readers;  // bit per reader slot
+} shm_rec_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    _Alignas(64) _Atomic uint64_t head;
+    _Atomic uint32_t futex;
+    _Atomic uint32_t sleepers;
+    struct {
+        _Alignas(64) _Atomic uint64_t tail;
+    } readers[SHM_READERS];
+    _Alignas(64) char data[];
+} shm_ring_t;
+
+typedef struct shm_reader shm_reader_t;
+
+// start of a frame from one publisher that ran past the end of a receive buffer
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int log_slot;   //log_positions entry of its publisher + 1, 0 for none
+    shm_reader_t *shm; //its ring reader, once the publisher moved us there
+    int repair_source; //mcast_sources entry of the repair being read
+    uint64_t repair_seq; //seq of the next repaired frame
+    uint64_t repair_left; //repaired frames still to come
+    int closing;    //recv being cancelled, the fd closes on its last completion
+} conn_t;
+
+typedef struct recv_thread recv_thread_t;
+typedef struct heap_pool heap_pool_t;
+
+// A receive buffer lent to the application. Buffers of the ring have one
+// each, a frame put together from two buffers gets its own with heap set.
+// Batches of a shared-memory ring point into the ring and set done
+struct mqsub_batch {
+    recv_thread_t *owner;
+    int bid;
+    char *heap;                //malloc'd frame, back to pool on release
+    size_t heap_cap;
+    heap_pool_t *pool;
+    struct mqsub_batch *next;  //on owner->returned or pool
+    shm_reader_t *shm;
+    uint64_t end;              //ring position after its records
+    _Atomic int done;
+};
+
+// Heap batches with their buffers, kept for reuse. mqsub_release puts them
+// back from any thread, only the owner takes them, a whole list at a time
+struct heap_pool {
+    _Atomic(mqsub_batch_t *) returned;
+    mqsub_batch_t *free;       //owner only
+    _Atomic uint32_t futex;    //bumped by a put while the owner waits
+    _Atomic int sleeping;
+};
+
+// Reads one publisher's shared-memory ring on its own thread, handing
+// messages to on_batch in place. The ring's tail for our slot only moves
+// past batches the application has released, in order
+struct shm_reader {
+    pthread_t thread;
+    shm_ring_t *ring;
+    size_t map_len;
+    int slot;
+    _Atomic int stop;          //the publisher's connection closed
+    conn_t conn;               //log position of the publisher
+    mqsub_batch_t batches[SHM_BATCHES]; //lent out, oldest at first
+    int first;
+    int count;
+    mqsub_msg_t views[MAX_BATCH];
+};
+
+// One receive thread. Each has its own ring, provided buffers and
+// SO_REUSEPORT listen socket on the shared port, the kernel spreads
+// publisher connections over them. Counters are only written by their
+// thread and summed by mqsub_stats
+struct recv_thread {
+    pthread_t thread;
+    int listen_fd;
+    struct io_uring ring;
+    int fixed_files;                     //sockets are in the ring's file table at index fd
+    struct io_uring_buf_ring *recv_ring; //provided buffers, the kernel picks one per recv
+    char *recv_buffers;                  //RECV_BUFFERS * RECV_BUFFER_SIZE
+    mqsub_batch_t batches[RECV_BUFFERS]; //one per provided buffer
+    mqsub_msg_t views[MAX_BATCH];        //handed to on_batch
+    int starved[MAX_CONNS];              //fds whose recv ran out of buffers
+    int starved_count;
+    int wake_fd;                         //eventfd, buffers came back from another thread
+    uint64_t wake_count;
+    _Alignas(64) _Atomic(mqsub_batch_t *) returned; //released on other threads
+    _Atomic int waiting;                 //starved fds and nothing returned yet
+    heap_pool_t split_pool;              //batches for frames split across buffers
+    _Alignas(64) _Atomic uint64_t reads;
+    _Atomic uint64_t msgs;
+    _Atomic uint64_t read_err;
+    _Atomic uint64_t closed;
+};
+
+static recv_thread_t *recv_threads;
+static int recv_thread_count = 1;
+static int ring_mode = MQSUB_RING_DEFAULT;
+static mqsub_callback_t on_batch;
+static void *on_batch_ctx;
+static conn_t conns[MAX_CONNS]; //indexed by fd, an fd belongs to the thread that accepted it
+static char **subscribed_topics = NULL;
+static uint16_t topic_count = 0;
+static uint32_t subscriber_id; //to be put in every heartbeat system_id
+static uint16_t listen_port; //find available port
+static uint8_t bp_policy = BP_DROP_NEWEST;
+static uint32_t bp_lag_limit = 0;
+static pthread_mutex_t topics_lock = PTHREAD_MUTEX_INITIALIZER; //topic list and epoch
+static uint32_t topic_epoch = 0;
+static int heartbeat_fd = -1;
+static struct sockaddr_in broadcast_addr;
+static uint32_t replay_ms;
+static _Atomic int shared_memory; //cleared by a receive thread, read by the heartbeat thread
+static _Atomic uint64_t shm_msgs;
+static _Atomic int multicast; //like shared_memory
+static _Atomic uint64_t mcast_msgs;
+static _Atomic uint64_t mcast_gaps;
+static _Atomic uint64_t mcast_lost;
+// seq from..to asked for again, last at asked
+typedef struct {
+    uint64_t from;
+    uint64_t to;
+    time_t asked;
+    int tries;
+} mcast_missing_t;
+// publisher groups we were moved to. An entry is filled in before source is
+// set and only its socket's thread touches next_seq after that. source goes
+// back to 0 when we unsubscribe the pattern
+static struct {
+    _Atomic uint32_t source;
+    uint16_t group;
+    int sock;                  //mcast_sockets entry
+    uint64_t next_seq;
+    _Atomic uint64_t lvc_gen;  //messages up to this last-value generation came in the snapshot
+    mcast_missing_t missing[MCAST_MISSING]; //under mcast_lock
+    int missing_count;
+    char pattern[MAX_TOPIC_LEN + 1];
+} mcast_sources[MCAST_SOURCES];
+static struct {
+    uint32_t addr;
+    uint16_t port;
+    int fd;
+    heap_pool_t pool;  //MCAST_BLOCKS batches, the reader waits for one to come back
+} mcast_sockets[MCAST_SOCKETS];
+static int mcast_socket_count;
+static pthread_mutex_t mcast_lock = PTHREAD_MUTEX_INITIALIZER; //claiming entries of both
+// next seq wanted from each publisher log, sent in HB_FULL so a publisher
+// that lost us replays from there. An entry is claimed once, by log id
+static struct {
+    _Atomic uint32_t log_id;
+    _Atomic uint64_t next_seq;
+} log_positions[MAX_LOGS];
+
+
+// check whether already subscribed
+static int is_subscribed(const char *topic) {
+    for (int i = 0; i < topic_count; ++i) {
+        if (strcmp(subscribed_topics[i], topic) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Broadcast one heartbeat of the given type. FULL carries every topic,
+// DELTA the count (op, topic) changes passed in. Called with topics_lock held
+static void send_heartbeat(uint8_t type, const uint8_t *ops, char **topics, int count) {
+    char packet[HB_MAX_SIZE];
+    heartbeat_t *hb = (heartbeat_t *)packet;
+    size_t len = sizeof(*hb);
+
+    if (heartbeat_fd < 0) {
+        return; //not set up yet, the first FULL will carry it
+    }
+    memset(hb, 0, sizeof(*hb));
+    hb->version = HB_VERSION;
+    hb->type = type;
+    hb->policy = bp_policy;
+    hb->system_id = htonl(subscriber_id);
+    hb->epoch = htonl(topic_epoch);
+    hb->lag_limit = htonl(bp_lag_limit);
+    hb->advertised_port = htons(listen_port);
+    hb->flags = htons((shared_memory ? HB_F_SHM : 0) | (multicast ? HB_F_MCAST : 0));
+    hb->timestamp = htobe64(time(NULL));
+
+    for (int i = 0; i < count; ++i) {
+        size_t tlen = strnlen(topics[i], MAX_TOPIC_LEN - 1);
+        if (len + 2 + tlen > sizeof(packet)) {
+            break;
+        }
+        packet[len] = ops ? ops[i] : HB_ADD;
+        packet[len + 1] = tlen;
+        memcpy(packet + len + 2, topics[i], tlen);
+        len += 2 + tlen;
+        hb->count++;
+    }
+    // where to resume each publisher log, then how far back to start new ones
+    for (int i = 0; type == HB_FULL && i <= MAX_LOGS; ++i) {
+        uint32_t id = 0;
+        uint64_t seq;
+        if (i < MAX_LOGS) {
+            id = atomic_load(&log_positions[i].log_id);
+            seq = atomic_load(&log_positions[i].next_seq);
+            if (!id) {
+                continue;
+            }
+        } else if (replay_ms) {
+            seq = (uint64_t)time(NULL) * 1000 - replay_ms;
+        } else {
+            break;
+        }
+        if (len + 2 + sizeof(id) + sizeof(seq) > sizeof(packet) || hb->count == UINT8_MAX) {
+            break;
+        }
+        packet[len] = HB_RESUME;
+        packet[len + 1] = sizeof(id) + sizeof(seq);
+        id = htonl(id);
+        seq = htobe64(seq);
+        memcpy(packet + len + 2, &id, sizeof(id));
+        memcpy(packet + len + 2 + sizeof(id), &seq, sizeof(seq));
+        len += 2 + sizeof(id) + sizeof(seq);
+        hb->count++;
+    }
+
+    if (sendto(heartbeat_fd, packet, len, 0, (struct sockaddr *)&broadcast_addr, sizeof(broadcast_addr)) < 0) {
+        perror("Failed to beat.");
+    }
+}
+
+int mqsub_subscribe(const char *topic){
+    if (!topic){
+        return -1;
+    } 
+    pthread_mutex_lock(&topics_lock);
+    if (is_subscribed(topic)){
+        pthread_mutex_unlock(&topics_lock);
+        return 0;
+    }
+
+    if (topic_count >= TOPIC_CAPACITY) {
+        printf("[SUB] Topics at capacity\n");
+    }
+    else{
+        printf("[SUB] Added subscription for %s\n", topic);
+        subscribed_topics[topic_count++] = strdup(topic);
+        // publishers see it now, not at the next beat
+        uint8_t op = HB_ADD;
+        topic_epoch++;
+        send_heartbeat(HB_DELTA, &op, (char **)&topic, 1);
+    }
+    pthread_mutex_unlock(&topics_lock);
+
+    return 0;
+}
+
+// stop taking a pattern from multicast, its publishers move it back to TCP
+static void mcast_forget(const char *topic) {
+    for (int i = 0; i < MCAST_SOURCES; i++) {
+        if (atomic_load(&mcast_sources[i].source) && strcmp(mcast_sources[i].pattern, topic) == 0) {
+            atomic_store(&mcast_sources[i].source, 0);
+        }
+    }
+}
+
+int mqsub_unsubscribe(const char *topic) {
+    pthread_mutex_lock(&topics_lock);
+    for (int i = 0; i < topic_count; ++i) {
+        if (strcmp(subscribed_topics[i], topic) == 0) {
+            free(subscribed_topics[i]);
+            //close the gap
+            for (int j = i; j < topic_count - 1; ++j)
+                subscribed_topics[j] = subscribed_topics[j + 1];
+            subscribed_topics[--topic_count] = NULL;
+            uint8_t op = HB_REMOVE;
+            topic_epoch++;
+            send_heartbeat(HB_DELTA, &op, (char **)&topic, 1);
+            pthread_mutex_unlock(&topics_lock);
+            mcast_forget(topic);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&topics_lock);
+    return 0;
+}
+
+static uint32_t generate_id() {
+    uint32_t pid_part = (uint32_t)getpid();
+    uint32_t time_part = (uint32_t)time(NULL);
+    return (pid_part * 31) ^ (time_part);
+}
+
+
+// Create UDP socket
+static int setup_heartbeat(){
+    int hb_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (hb_sock < 0) {
+        perror("socket");
+        return -1;
+    }
+         // Enable broadcast option
+    int broadcast_enable = 1;
+    if (setsockopt(hb_sock, SOL_SOCKET, SO_BROADCAST, &broadcast_enable, sizeof(broadcast_enable)) == -1) {
+        perror("setsockopt - SO_BROADCAST");
+        close(hb_sock);
+        return -1;
+    }
+    // Configure broadcast address
+    memset(&broadcast_addr, 0, sizeof(broadcast_addr));
+    broadcast_addr.sin_family = AF_INET;
+    broadcast_addr.sin_port = htons(HEARTBEAT_PORT);
+
+    if (inet_pton(AF_INET, BROADCAST_IP, &broadcast_addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(hb_sock);
+        return -1;
+    }
+    heartbeat_fd = hb_sock;
+    return hb_sock;
+}
+
+static void mcast_retry(void);
+
+//broadcast heartbeat: the whole list once, then pings. publishers that
+//missed something NAK on the same socket and get the whole list again
+static void *heartbeat_thread(void *arg){
+    int hb_sock = *(int *)arg;
+    printf("[SUB] Heartbeat thread started. Broadcasting heartbeat to %s:%d...\n",
+           BROADCAST_IP, HEARTBEAT_PORT);
+
+    pthread_mutex_lock(&topics_lock);
+    send_heartbeat(HB_FULL, NULL, subscribed_topics, topic_count);
+    pthread_mutex_unlock(&topics_lock);
+    time_t next_ping = time(NULL) + HEARTBEAT_INTERVAL;
+
+    while (1) {
+        struct pollfd pfd = { .fd = hb_sock, .events = POLLIN };
+        int wait_ms = (next_ping - time(NULL)) * 1000;
+        if (poll(&pfd, 1, wait_ms > 0 ? wait_ms : 0) > 0) {
+            heartbeat_t nak;
+            ssize_t n = recv(hb_sock, &nak, sizeof(nak), 0);
+            if (n == (ssize_t)sizeof(nak) && nak.version == HB_VERSION &&
+                nak.type == HB_NAK && ntohl(nak.system_id) == subscriber_id) {
+                pthread_mutex_lock(&topics_lock);
+                send_heartbeat(HB_FULL, NULL, subscribed_topics, topic_count);
+                pthread_mutex_unlock(&topics_lock);
+            }
+        }
+        if (time(NULL) >= next_ping) {
+            pthread_mutex_lock(&topics_lock);
+            send_heartbeat(HB_PING, NULL, NULL, 0);
+            pthread_mutex_unlock(&topics_lock);
+            mcast_retry();
+            next_ping = time(NULL) + HEARTBEAT_INTERVAL;
+        }
+    }
+    return NULL;
+}
+
+// Set up the thread's ring for ring_mode and a sparse file table of
+// MAX_CONNS, so sockets can be used as fixed files. A DEFER ring starts
+// disabled and the receive thread enables it, it then becomes the only
+// task allowed to submit
+static int setup_ring(recv_thread_t *t) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (ring_mode == MQSUB_RING_SQPOLL) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    } else if (ring_mode == MQSUB_RING_DEFER) {
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    }
+    int ret = io_uring_queue_init_params(QUEUE_DEPTH, &t->ring, &params);
+    if (ret < 0 && params.flags) {
+        fprintf(stderr, "[SUB] ring mode not supported (%s), using a plain ring\n", strerror(-ret));
+        memset(&params, 0, sizeof(params));
+        ret = io_uring_queue_init_params(QUEUE_DEPTH, &t->ring, &params);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "[SUB] io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+    t->fixed_files = io_uring_register_files_sparse(&t->ring, MAX_CONNS) == 0;
+    return 0;
+}
+
+// put fd in the file table at index fd, -1 as file takes it out
+static int register_file(recv_thread_t *t, int fd, int file) {
+    if (!t->fixed_files) {
+        return 0;
+    }
+    if (fd >= MAX_CONNS) {
+        return -1;
+    }
+    return io_uring_register_files_update(&t->ring, fd, &file, 1) == 1 ? 0 : -1;
+}
+
+static struct io_uring_sqe *recv_sqe(recv_thread_t *t) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&t->ring);
+    if (!sqe) {
+        // SQ ring full, push what we have and try again
+        io_uring_submit(&t->ring);
+        sqe = io_uring_get_sqe(&t->ring);
+    }
+    return sqe;
+}
+
+// socket sqes name the file table index when there is one
+static inline void sqe_file(recv_thread_t *t, struct io_uring_sqe *sqe) {
+    if (t->fixed_files) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+// one accept that keeps producing a completion per connection
+static void add_accept_request(recv_thread_t *t, int server_socket) {
+    struct io_uring_sqe *sqe = recv_sqe(t);
+    io_uring_prep_multishot_accept(sqe, server_socket, NULL, NULL, 0);
+    sqe_file(t, sqe);
+    io_uring_sqe_set_data64(sqe, EV_DATA(TYPE_ACCEPT, server_socket));
+}
+
+// one recv per connection that keeps completing into provided buffers
+static void add_read_request(recv_thread_t *t, int client_socket) {
+    struct io_uring_sqe *sqe = recv_sqe(t);
+    io_uring_prep_recv_multishot(sqe, client_socket, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe_file(t, sqe);
+    sqe->buf_group = RECV_BGID;
+    io_uring_sqe_set_data64(sqe, EV_DATA(TYPE_READ, client_socket));
+}
+
+// register the provided buffer ring and fill it
+static int setup_recv_buffers(recv_thread_t *t) {
+    int ret;
+    t->recv_ring = io_uring_setup_buf_ring(&t->ring, RECV_BUFFERS, RECV_BGID, 0, &ret);
+    if (!t->recv_ring) {
+        fprintf(stderr, "[SUB] io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        return -1;
+    }
+    t->recv_buffers = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    if (!t->recv_buffers) {
+        perror("[SUB] malloc");
+        return -1;
+    }
+    for (int i = 0; i < RECV_BUFFERS; i++) {
+        t->batches[i].owner = t;
+        t->batches[i].bid = i;
+        io_uring_buf_ring_add(t->recv_ring, t->recv_buffers + (size_t)i * RECV_BUFFER_SIZE,
+                              RECV_BUFFER_SIZE, i, io_uring_buf_ring_mask(RECV_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(t->recv_ring, RECV_BUFFERS);
+    return 0;
+}
+
+// read on the eventfd other threads poke when they return buffers
+static void add_wake_request(recv_thread_t *t) {
+    struct io_uring_sqe *sqe = recv_sqe(t);
+    io_uring_prep_read(sqe, t->wake_fd, &t->wake_count, sizeof(t->wake_count), 0);
+    io_uring_sqe_set_data64(sqe, EV_DATA(TYPE_WAKE, t->wake_fd));
+}
+
+// Hand a buffer back to the kernel. Receive thread only. Connections that
+// ran out of buffers get their recv back
+static void recycle_recv_buffer(recv_thread_t *t, int bid) {
+    io_uring_buf_ring_add(t->recv_ring, t->recv_buffers + (size_t)bid * RECV_BUFFER_SIZE,
+                          RECV_BUFFER_SIZE, bid, io_uring_buf_ring_mask(RECV_BUFFERS), 0);
+    io_uring_buf_ring_advance(t->recv_ring, 1);
+    if (t->starved_count) {
+        for (int i = 0; i < t->starved_count; i++) {
+            add_read_request(t, t->starved[i]);
+        }
+        t->starved_count = 0;
+        atomic_store(&t->waiting, 0);
+    }
+}
+
+// take back the buffers other threads released
+static void collect_returned(recv_thread_t *t) {
+    mqsub_batch_t *b = atomic_exchange(&t->returned, NULL);
+    while (b) {
+        mqsub_batch_t *next = b->next;
+        recycle_recv_buffer(t, b->bid);
+        b = next;
+    }
+}
+
+static void heap_pool_put(heap_pool_t *pool, mqsub_batch_t *batch) {
+    mqsub_batch_t *head = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+    do {
+        batch->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->returned, &head, batch,
+                                                    memory_order_seq_cst,
+                                                    memory_order_relaxed));
+    if (atomic_load(&pool->sleeping)) {
+        atomic_fetch_add(&pool->futex, 1);
+        syscall(SYS_futex, &pool->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// a pooled batch, NULL when none has come back. Owner only
+static mqsub_batch_t *heap_pool_get(heap_pool_t *pool) {
+    if (!pool->free) {
+        pool->free = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+    }
+    mqsub_batch_t *batch = pool->free;
+    if (batch) {
+        pool->free = batch->next;
+    }
+    return batch;
+}
+
+// a pooled batch, sleeping until the application releases one. Owner only
+static mqsub_batch_t *heap_pool_wait(heap_pool_t *pool) {
+    mqsub_batch_t *batch;
+    while (!(batch = heap_pool_get(pool))) {
+        uint32_t seen = atomic_load(&pool->futex);
+        atomic_store(&pool->sleeping, 1);
+        // set sleeping before looking at returned again
+        if (!atomic_load(&pool->returned)) {
+            syscall(SYS_futex, &pool->futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+        }
+        atomic_store(&pool->sleeping, 0);
+    }
+    return batch;
+}
+
+void mqsub_release(mqsub_batch_t *batch) {
+    if (batch->shm) {
+        atomic_store_explicit(&batch->done, 1, memory_order_release);
+        return; //its reader moves the tail
+    }
+    if (batch->pool) {
+        heap_pool_put(batch->pool, batch);
+        return;
+    }
+    if (batch->heap) {
+        free(batch->heap);
+        free(batch);
+        return;
+    }
+    recv_thread_t *t = batch->owner;
+    if (pthread_equal(pthread_self(), t->thread)) {
+        recycle_recv_buffer(t, batch->bid); //released from on_batch
+        return;
+    }
+    mqsub_batch_t *head = atomic_load_explicit(&t->returned, memory_order_relaxed);
+    do {
+        batch->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&t->returned, &head, batch,
+                                                    memory_order_seq_cst,
+                                                    memory_order_relaxed));
+    // only a thread that is out of buffers needs waking
+    if (atomic_load(&t->waiting) && atomic_exchange(&t->waiting, 0)) {
+        uint64_t one = 1;
+        if (write(t->wake_fd, &one, sizeof(one)) < 0) {
+            perror("[SUB] wake");
+        }
+    }
+}
+
+// Listen on *out_port, or on a free port when it is 0 and put that in
+// *out_port. Every receive thread listens on the same port (SO_REUSEPORT)
+static int setup_listen_socket(uint16_t *out_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(*out_port) //0 asks for a free port
+    };
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("[SUB] bind fail");
+        close(sock);
+        return -1;
+    }
+
+    socklen_t len = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr*)&addr, &len) < 0) {
+        perror("[SUB] getsockname fail");
+        close(sock);
+        return -1;
+    }
+    *out_port = ntohs(addr.sin_port);
+
+    listen(sock, SOMAXCONN);
+    printf("[SUB] Listening on port %u\n", *out_port);
+    return sock;
+}
+
+
+// Size of the frame starting at buf, header included.
+// Returns -1 on a malformed stream
+static long frame_size(const char *buf) {
+    frame_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    size_t topic_len = ntohs(hdr.topic_len);
+    if (topic_len == 0 || topic_len > MAX_TOPIC_LEN) {
+        return -1;
+    }
+    size_t ext = (ntohs(hdr.flags) & FRAME_SEQ) ? sizeof(frame_seq_t) : 0;
+    return sizeof(hdr) + ext + topic_len + ntohl(hdr.len);
+}
+
+// log_positions entry for a publisher log, claiming a free one for a new
+// log. -1 when they are all taken
+static int log_position(uint32_t log_id) {
+    for (int i = 0; i < MAX_LOGS; i++) {
+        uint32_t id = atomic_load(&log_positions[i].log_id);
+        if (!id && atomic_compare_exchange_strong(&log_positions[i].log_id, &id, log_id)) {
+            return i;
+        }
+        if (id == log_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Move the resume position of conn's publisher log past seq. Returns 0 for
+// a message we already had: the live frames that overlap the end of a replay
+static int log_advance(conn_t *conn, uint32_t log_id, uint64_t seq) {
+    if (!conn->log_slot || atomic_load(&log_positions[conn->log_slot - 1].log_id) != log_id) {
+        conn->log_slot = log_position(log_id) + 1;
+        if (!conn->log_slot) {
+            return 1;
+        }
+    }
+    _Atomic uint64_t *next = &log_positions[conn->log_slot - 1].next_seq;
+    if (seq < atomic_load(next)) {
+        return 0;
+    }
+    atomic_store(next, seq + 1);
+    return 1;
+}
+
+// move our tail past the batches the application is done with
+static void shm_retire(shm_reader_t *r) {
+    uint64_t tail = 0;
+    int moved = 0;
+    while (r->count && atomic_load_explicit(&r->batches[r->first].done, memory_order_acquire)) {
+        tail = r->batches[r->first].end;
+        r->first = (r->first + 1) % SHM_BATCHES;
+        r->count--;
+        moved = 1;
+    }
+    if (moved) {
+        atomic_store_explicit(&r->ring->readers[r->slot].tail, tail, memory_order_release);
+    }
+}
+
+// sleep until the publisher writes past pos, or a while
+static void shm_wait(shm_reader_t *r, uint64_t pos) {
+    shm_ring_t *ring = r->ring;
+    atomic_fetch_add(&ring->sleepers, 1);
+    uint32_t seen = atomic_load(&ring->futex);
+    if (atomic_load(&ring->head) == pos && !atomic_load(&r->stop)) {
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = SHM_SLEEP_NS };
+        syscall(SYS_futex, &ring->futex, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+}
+
+// view of every record for our slot from *pos up to head, at most MAX_BATCH
+static size_t shm_collect(shm_reader_t *r, uint64_t *pos, uint64_t head) {
+    shm_ring_t *ring = r->ring;
+    uint64_t mask = 1ULL << r->slot;
+    size_t count = 0;
+    while (*pos != head && count < MAX_BATCH) {
+        const shm_rec_t *rec = (const shm_rec_t *)(ring->data + (*pos & (ring->size - 1)));
+        *pos += rec->size;
+        if (rec->skip || !(rec->readers & mask)) {
+            continue;
+        }
+        const char *frame = (const char *)(rec + 1);
+        frame_hdr_t hdr;
+        frame_seq_t fs = {0};
+        memcpy(&hdr, frame, sizeof(hdr));
+        size_t ext = 0;
+        if (ntohs(hdr.flags) & FRAME_SEQ) {
+            memcpy(&fs, frame + sizeof(hdr), sizeof(fs));
+            ext = sizeof(fs);
+            if (!log_advance(&r->conn, ntohl(fs.log_id), be64toh(fs.seq))) {
+                continue;
+            }
+        }
+        mqsub_msg_t *m = &r->views[count++];
+        m->topic = frame + sizeof(hdr) + ext;
+        m->topic_len = ntohs(hdr.topic_len);
+        m->payload = m->topic + m->topic_len;
+        m->len = ntohl(hdr.len);
+        m->seq = be64toh(fs.seq);
+    }
+    return count;
+}
+
+static void *shm_reader_loop(void *arg) {
+    shm_reader_t *r = arg;
+    uint64_t pos = atomic_load(&r->ring->readers[r->slot].tail);
+    int idle = 0;
+    while (!atomic_load_explicit(&r->stop, memory_order_relaxed)) {
+        shm_retire(r);
+        uint64_t head = atomic_load(&r->ring->head);
+        if (pos == head || r->count == SHM_BATCHES) {
+            if (++idle < SHM_SPIN) {
+                sched_yield();
+            } else if (r->count == SHM_BATCHES) {
+                usleep(100); //the application holds every batch
+            } else {
+                shm_wait(r, pos);
+                idle = 0;
+            }
+            continue;
+        }
+        idle = 0;
+        size_t count = shm_collect(r, &pos, head);
+        // a batch even with nothing for us, so the tail moves in order
+        mqsub_batch_t *b = &r->batches[(r->first + r->count) % SHM_BATCHES];
+        r->count++;
+        b->shm = r;
+        b->end = pos;
+        atomic_store(&b->done, count == 0);
+        if (count) {
+            atomic_fetch_add_explicit(&shm_msgs, count, memory_order_relaxed);
+            on_batch(on_batch_ctx, b, r->views, count);
+        }
+    }
+    // the publisher dropped us, the ring goes once nothing points into it
+    while (r->count) {
+        shm_retire(r);
+        if (r->count) {
+            usleep(1000);
+        }
+    }
+    munmap(r->ring, r->map_len);
+    free(r);
+    return NULL;
+}
+
+// Start reading the publisher's ring name (len bytes) at reader slot.
+// Returns -1 if it can not be mapped, shared memory is then turned off
+// and the caller drops the connection, the publisher gets us back on TCP
+static int shm_attach(conn_t *conn, const char *name, size_t len, uint32_t slot) {
+    char path[MAX_TOPIC_LEN + 1];
+    if (conn->shm) {
+        return 0;
+    }
+    memcpy(path, name, len);
+    path[len] = '\0';
+    shm_reader_t *r = NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd = slot < SHM_READERS ? shm_open(path, O_RDWR, 0) : -1;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(shm_ring_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (map != MAP_FAILED && ((shm_ring_t *)map)->magic == SHM_MAGIC &&
+        (r = calloc(1, sizeof(*r)))) {
+        r->ring = map;
+        r->map_len = st.st_size;
+        r->slot = slot;
+        if (pthread_create(&r->thread, NULL, shm_reader_loop, r) == 0) {
+            pthread_detach(r->thread);
+            conn->shm = r;
+            printf("[SUB] Reading %s from shared memory, slot %u\n", path, slot);
+            return 0;
+        }
+        free(r);
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    fprintf(stderr, "[SUB] Can not read shared memory %s, back to TCP\n", path);
+    shared_memory = 0;
+    pthread_mutex_lock(&topics_lock);
+    send_heartbeat(HB_FULL, NULL, subscribed_topics, topic_count);
+    pthread_mutex_unlock(&topics_lock);
+    return -1;
+}
+
+// ask the group's publisher for seq from..to on our TCP stream
+static void mcast_request(uint32_t source, uint16_t group, uint64_t from, uint64_t to) {
+    char packet[sizeof(heartbeat_t) + sizeof(mcast_repair_t)];
+    heartbeat_t *hb = (heartbeat_t *)packet;
+    memset(hb, 0, sizeof(*hb));
+    hb->version = HB_VERSION;
+    hb->type = HB_REPAIR;
+    hb->system_id = htonl(subscriber_id);
+    hb->advertised_port = htons(listen_port);
+    hb->timestamp = htobe64(time(NULL));
+    mcast_repair_t req = {
+        .source = htonl(source),
+        .group = htons(group),
+        .from = htobe64(from),
+        .to = htobe64(to),
+    };
+    memcpy(hb + 1, &req, sizeof(req));
+    if (sendto(heartbeat_fd, packet, sizeof(packet), 0, (struct sockaddr *)&broadcast_addr,
+               sizeof(broadcast_addr)) < 0) {
+        perror("[SUB] repair request");
+    }
+}
+
+// Take seq from..to out of a source's missing ranges, they came in or are
+// gone. Returns how many of them were missing. Called with mcast_lock held
+static uint64_t mcast_missing_take(int i, uint64_t from, uint64_t to) {
+    uint64_t taken = 0;
+    for (int r = 0; r < mcast_sources[i].missing_count; ) {
+        mcast_missing_t *m = &mcast_sources[i].missing[r];
+        uint64_t lo = m->from > from ? m->from : from;
+        uint64_t hi = m->to < to ? m->to : to;
+        if (lo > hi) {
+            r++;
+            continue;
+        }
+        taken += hi - lo + 1;
+        m->tries = 0; //repairs are getting through
+        if (lo == m->from && hi == m->to) {
+            *m = mcast_sources[i].missing[--mcast_sources[i].missing_count];
+            continue;
+        }
+        if (lo > m->from && hi < m->to) {
+            // a hole in the middle, the part after it gets its own entry
+            if (mcast_sources[i].missing_count < MCAST_MISSING) {
+                mcast_sources[i].missing[mcast_sources[i].missing_count++] =
+                    (mcast_missing_t){ .from = hi + 1, .to = m->to, .asked = m->asked };
+            } else {
+                atomic_fetch_add(&mcast_lost, m->to - hi);
+            }
+            m->to = lo - 1;
+        } else if (lo > m->from) {
+            m->to = lo - 1;
+        } else {
+            m->from = hi + 1;
+        }
+        r++;
+    }
+    return taken;
+}
+
+// heartbeat thread. Ask again for what has not come back in
+// MCAST_REPAIR_WAIT, give up on it after MCAST_REPAIR_TRIES requests
+static void mcast_retry(void) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&mcast_lock);
+    for (int i = 0; i < MCAST_SOURCES; i++) {
+        uint32_t source = atomic_load(&mcast_sources[i].source);
+        for (int r = 0; r < mcast_sources[i].missing_count; ) {
+            mcast_missing_t *m = &mcast_sources[i].missing[r];
+            if (source && now - m->asked < MCAST_REPAIR_WAIT) {
+                r++;
+                continue;
+            }
+            if (source && m->tries < MCAST_REPAIR_TRIES) {
+                m->asked = now;
+                m->tries++;
+                mcast_request(source, mcast_sources[i].group, m->from, m->to);
+                r++;
+                continue;
+            }
+            if (source) {
+                atomic_fetch_add(&mcast_lost, m->to - m->from + 1);
+                fprintf(stderr, "[SUB] Lost multicast messages %lu-%lu of %s\n",
+                        (unsigned long)m->from, (unsigned long)m->to, mcast_sources[i].pattern);
+            }
+            *m = mcast_sources[i].missing[--mcast_sources[i].missing_count];
+        }
+    }
+    pthread_mutex_unlock(&mcast_lock);
+}
+
+// A FRAME_REPAIR: the ones it no longer has are lost, the next frames on
+// the stream are seq kept..to of its group
+static void mcast_repaired(conn_t *conn, const mcast_repaired_t *rep) {
+    uint32_t source = ntohl(rep->source);
+    uint16_t group = ntohs(rep->group);
+    uint64_t asked = be64toh(rep->asked), kept = be64toh(rep->kept), to = be64toh(rep->to);
+    uint64_t lost = 0;
+    pthread_mutex_lock(&mcast_lock);
+    int i = 0;
+    while (i < MCAST_SOURCES && !(atomic_load(&mcast_sources[i].source) == source &&
+                                  mcast_sources[i].group == group)) {
+        i++;
+    }
+    if (i < MCAST_SOURCES && kept > asked) {
+        lost = mcast_missing_take(i, asked, kept - 1 < to ? kept - 1 : to);
+    }
+    pthread_mutex_unlock(&mcast_lock);
+    conn->repair_source = i < MCAST_SOURCES ? i : -1;
+    conn->repair_seq = kept;
+    conn->repair_left = kept <= to ? to - kept + 1 : 0;
+    if (lost) {
+        atomic_fetch_add(&mcast_lost, lost);
+        fprintf(stderr, "[SUB] Lost %lu multicast messages, too old to repair\n", (unsigned long)lost);
+    }
+}
+
+// a repaired frame is delivered if its seq is still missing, not if an
+// earlier request already brought it
+static int mcast_repair_keep(conn_t *conn) {
+    uint64_t seq = conn->repair_seq++;
+    conn->repair_left--;
+    if (conn->repair_source < 0) {
+        return 0; //we no longer read that group
+    }
+    pthread_mutex_lock(&mcast_lock);
+    uint64_t taken = mcast_missing_take(conn->repair_source, seq, seq);
+    pthread_mutex_unlock(&mcast_lock);
+    return taken != 0;
+}
+
+// Check one datagram's seq and point view at its frame. A gap is asked
+// for again and the datagram still delivered, repairs come in on TCP.
+// Returns 0 for a datagram that is not ours, or that we already had
+static int mcast_datagram(int sock, const char *buf, size_t len, mqsub_msg_t *view) {
+    mcast_hdr_t hdr;
+    frame_hdr_t fh;
+    if (len < sizeof(hdr) + sizeof(fh)) {
+        return 0;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    uint32_t source = ntohl(hdr.source);
+    uint16_t group = ntohs(hdr.group);
+    int i = 0;
+    while (i < MCAST_SOURCES && !(atomic_load(&mcast_sources[i].source) == source &&
+                                  mcast_sources[i].group == group && mcast_sources[i].sock == sock)) {
+        i++;
+    }
+    if (i == MCAST_SOURCES) {
+        return 0; //a group of a publisher that did not move us there
+    }
+    const char *frame = buf + sizeof(hdr);
+    long total = frame_size(frame);
+    if (total < 0 || (size_t)total != len - sizeof(hdr)) {
+        return 0;
+    }
+    uint64_t seq = be64toh(hdr.seq);
+    uint64_t *next = &mcast_sources[i].next_seq;
+    if (seq < *next) {
+        return 0;
+    }
+    if (seq > *next) {
+        atomic_fetch_add(&mcast_gaps, seq - *next);
+        pthread_mutex_lock(&mcast_lock);
+        int room = mcast_sources[i].missing_count < MCAST_MISSING;
+        if (room) {
+            mcast_sources[i].missing[mcast_sources[i].missing_count++] = (mcast_missing_t){
+                .from = *next, .to = seq - 1, .asked = time(NULL), .tries = 1,
+            };
+        }
+        pthread_mutex_unlock(&mcast_lock);
+        if (room) {
+            mcast_request(source, group, *next, seq - 1);
+        } else {
+            atomic_fetch_add(&mcast_lost, seq - *next); //too many holes already
+        }
+    }
+    *next = seq + 1;
+    uint64_t gen = be64toh(hdr.lvc_gen);
+    if (gen && gen <= atomic_load_explicit(&mcast_sources[i].lvc_gen, memory_order_relaxed)) {
+        return 0; //its value was in the snapshot
+    }
+    memcpy(&fh, frame, sizeof(fh));
+    view->topic = frame + sizeof(fh);
+    view->topic_len = ntohs(fh.topic_len);
+    view->payload = view->topic + view->topic_len;
+    view->len = ntohl(fh.len);
+    view->seq = 0;
+    return 1;
+}
+
+// Receive one joined group address:port, a recvmmsg at a time into a
+// block of its pool that is lent out with the batch. With every block
+// lent out it waits for the application to release one
+static void *mcast_loop(void *arg) {
+    int sock = (int)(intptr_t)arg;
+    int fd = mcast_sockets[sock].fd;
+    heap_pool_t *pool = &mcast_sockets[sock].pool;
+    struct mmsghdr msgs[MCAST_BATCH];
+    struct iovec iovs[MCAST_BATCH];
+    mqsub_msg_t views[MCAST_BATCH];
+    mqsub_batch_t *batch = NULL;
+    while (1) {
+        if (!batch) {
+            batch = heap_pool_wait(pool);
+        }
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < MCAST_BATCH; i++) {
+            iovs[i].iov_base = batch->heap + (size_t)i * MCAST_DATAGRAM;
+            iovs[i].iov_len = MCAST_DATAGRAM;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fd, msgs, MCAST_BATCH, MSG_WAITFORONE, NULL);
+        size_t count = 0;
+        for (int i = 0; i < n; i++) {
+            count += mcast_datagram(sock, iovs[i].iov_base, msgs[i].msg_len, &views[count]);
+        }
+        if (!count) {
+            if (n < 0 && errno != EINTR) {
+                perror("[SUB] multicast recvmmsg");
+                return NULL;
+            }
+            continue; //the block is still ours
+        }
+        atomic_fetch_add_explicit(&mcast_msgs, count, memory_order_relaxed);
+        on_batch(on_batch_ctx, batch, views, count);
+        batch = NULL;
+    }
+    return NULL;
+}
+
+// fill a group socket's pool with its blocks, -1 if they can't be allocated
+static int mcast_pool_init(heap_pool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+    for (int i = 0; i < MCAST_BLOCKS; i++) {
+        mqsub_batch_t *batch = calloc(1, sizeof(*batch));
+        char *block = malloc(MCAST_BATCH * MCAST_DATAGRAM);
+        if (!batch || !block) {
+            free(batch);
+            free(block);
+            return -1;
+        }
+        batch->heap = block;
+        batch->heap_cap = MCAST_BATCH * MCAST_DATAGRAM;
+        batch->pool = pool;
+        batch->next = pool->free;
+        pool->free = batch;
+    }
+    return 0;
+}
+
+static void mcast_pool_free(heap_pool_t *pool) {
+    while (pool->free) {
+        mqsub_batch_t *next = pool->free->next;
+        free(pool->free->heap);
+        free(pool->free);
+        pool->free = next;
+    }
+}
+
+// mcast_sockets entry for a group, joining it the first time. Called with
+// mcast_lock held, -1 if it can not be joined
+static int mcast_join(const mcast_offer_t *offer) {
+    for (int s = 0; s < mcast_socket_count; s++) {
+        if (mcast_sockets[s].addr == offer->addr && mcast_sockets[s].port == offer->port) {
+            return s;
+        }
+    }
+    if (mcast_socket_count == MCAST_SOCKETS) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int yes = 1, rcvbuf = MCAST_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = offer->addr, //only this group's datagrams
+        .sin_port = offer->port,
+    };
+    // join on the interface the publisher sends from when it is one of ours
+    struct ip_mreq mreq = { .imr_multiaddr.s_addr = offer->addr, .imr_interface.s_addr = offer->iface };
+    int joined = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0 ||
+         (mreq.imr_interface.s_addr = htonl(INADDR_ANY),
+          setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0));
+    int s = mcast_socket_count;
+    pthread_t thread;
+    mcast_sockets[s].addr = offer->addr;
+    mcast_sockets[s].port = offer->port;
+    mcast_sockets[s].fd = fd;
+    if (!joined || mcast_pool_init(&mcast_sockets[s].pool) < 0 ||
+        pthread_create(&thread, NULL, mcast_loop, (void *)(intptr_t)s) != 0) {
+        perror("[SUB] multicast join");
+        mcast_pool_free(&mcast_sockets[s].pool);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    mcast_socket_count++;
+    printf("[SUB] Joined multicast %s:%u\n", inet_ntoa(addr.sin_addr), ntohs(offer->port));
+    return s;
+}
+
+// Read the pattern (len bytes) from the group offered from now on.
+// Returns -1 if it can not be joined, multicast is then turned off and the
+// caller drops the connection, the publisher gets us back on TCP
+static int mcast_attach(const char *pattern, size_t len, const mcast_offer_t *offer) {
+    uint32_t source = ntohl(offer->source);
+    uint16_t group = ntohs(offer->group);
+    pthread_mutex_lock(&mcast_lock);
+    int s = mcast_join(offer);
+    int free_entry = -1, known = 0;
+    for (int i = 0; i < MCAST_SOURCES && s >= 0; i++) {
+        uint32_t id = atomic_load(&mcast_sources[i].source);
+        if (id == source && mcast_sources[i].group == group) {
+            known = 1; //moved again after a reconnect, its seq carries on
+            atomic_store(&mcast_sources[i].lvc_gen, be64toh(offer->lvc_gen));
+            break;
+        }
+        if (!id && free_entry < 0) {
+            free_entry = i;
+        }
+    }
+    if (s >= 0 && !known && free_entry >= 0) {
+        mcast_sources[free_entry].group = group;
+        mcast_sources[free_entry].sock = s;
+        mcast_sources[free_entry].next_seq = be64toh(offer->next_seq);
+        mcast_sources[free_entry].missing_count = 0;
+        atomic_store(&mcast_sources[free_entry].lvc_gen, be64toh(offer->lvc_gen));
+        memcpy(mcast_sources[free_entry].pattern, pattern, len);
+        mcast_sources[free_entry].pattern[len] = '\0';
+        atomic_store(&mcast_sources[free_entry].source, source);
+    }
+    pthread_mutex_unlock(&mcast_lock);
+    if (s >= 0 && (known || free_entry >= 0)) {
+        return 0;
+    }
+    fprintf(stderr, "[SUB] Can not join multicast for %.*s, back to TCP\n", (int)len, pattern);
+    multicast = 0;
+    pthread_mutex_lock(&topics_lock);
+    send_heartbeat(HB_FULL, NULL, subscribed_topics, topic_count);
+    pthread_mutex_unlock(&topics_lock);
+    return -1;
+}
+
+// Add a view of every complete frame in buf to t->views from *count on.
+// Returns the bytes they took, the rest is the start of a partial frame.
+// -1 on a malformed stream
+static long parse_frames(recv_thread_t *t, conn_t *conn, const char *buf, size_t len, size_t *count) {
+    size_t off = 0;
+    while (len - off >= sizeof(frame_hdr_t)) {
+        long total = frame_size(buf + off);
+        if (total < 0) {
+            return -1;
+        }
+        if (len - off < (size_t)total) {
+            break; //partial frame
+        }
+        frame_hdr_t hdr;
+        frame_seq_t fs = {0};
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        size_t ext = 0;
+        if (ntohs(hdr.flags) & FRAME_SHM) {
+            uint32_t slot;
+            if (ntohl(hdr.len) != sizeof(slot)) {
+                return -1;
+            }
+            memcpy(&slot, buf + off + total - sizeof(slot), sizeof(slot));
+            if (shm_attach(conn, buf + off + sizeof(hdr), ntohs(hdr.topic_len), ntohl(slot)) < 0) {
+                return -1; //it is not sending on the stream any more
+            }
+            off += total;
+            continue;
+        }
+        if (ntohs(hdr.flags) & FRAME_MCAST) {
+            mcast_offer_t offer;
+            if (ntohl(hdr.len) != sizeof(offer)) {
+                return -1;
+            }
+            memcpy(&offer, buf + off + total - sizeof(offer), sizeof(offer));
+            if (mcast_attach(buf + off + sizeof(hdr), ntohs(hdr.topic_len), &offer) < 0) {
+                return -1; //it is not sending those on the stream any more
+            }
+            off += total;
+            continue;
+        }
+        if (ntohs(hdr.flags) & FRAME_REPAIR) {
+            mcast_repaired_t rep;
+            if (ntohl(hdr.len) != sizeof(rep)) {
+                return -1;
+            }
+            memcpy(&rep, buf + off + total - sizeof(rep), sizeof(rep));
+            mcast_repaired(conn, &rep);
+            off += total;
+            continue;
+        }
+        if (conn->repair_left && !mcast_repair_keep(conn)) {
+            off += total; //already repaired
+            continue;
+        }
+        if (ntohs(hdr.flags) & FRAME_SEQ) {
+            memcpy(&fs, buf + off + sizeof(hdr), sizeof(fs));
+            ext = sizeof(fs);
+            if (!log_advance(conn, ntohl(fs.log_id), be64toh(fs.seq))) {
+                off += total; //already delivered
+                continue;
+            }
+        }
+        mqsub_msg_t *m = &t->views[(*count)++];
+        m->topic = buf + off + sizeof(hdr) + ext;
+        m->topic_len = ntohs(hdr.topic_len);
+        m->payload = m->topic + m->topic_len;
+        m->len = ntohl(hdr.len);
+        m->seq = be64toh(fs.seq);
+        off += total;
+    }
+    return off;
+}
+
+// room for the whole split frame, it is lent out with it
+static int conn_reserve(conn_t *conn, size_t size) {
+    if (size <= conn->cap) {
+        return 0;
+    }
+    char *bigger = realloc(conn->buf, size);
+    if (!bigger) {
+        return -1;
+    }
+    conn->buf = bigger;
+    conn->cap = size;
+    return 0;
+}
+
+static void deliver(recv_thread_t *t, mqsub_batch_t *batch, size_t count) {
+    atomic_fetch_add_explicit(&t->msgs, count, memory_order_relaxed);
+    on_batch(on_batch_ctx, batch, t->views, count);
+}
+
+// Parse receive buffer bid from a publisher and pass its frames to on_batch
+// in place. Only a frame split across buffers is put together in the
+// connection buffer, which is then lent out on its own. The connection
+// takes the buffer of a pooled batch in exchange, so under load nothing
+// is allocated
+// Returns -1 on a malformed stream
+static int conn_recv(recv_thread_t *t, conn_t *conn, int bid, size_t n) {
+    const char *data = t->recv_buffers + (size_t)bid * RECV_BUFFER_SIZE;
+    size_t count = 0;
+    // finish the frame carried over from the last buffer first
+    while (conn->len && n) {
+        long want = conn->len < sizeof(frame_hdr_t) ? (long)sizeof(frame_hdr_t)
+                                                   : frame_size(conn->buf);
+        if (want < 0 || conn_reserve(conn, want) < 0) {
+            recycle_recv_buffer(t, bid);
+            return -1;
+        }
+        size_t take = want - conn->len < n ? want - conn->len : n;
+        memcpy(conn->buf + conn->len, data, take);
+        conn->len += take;
+        data += take;
+        n -= take;
+        if (conn->len == (size_t)want && want > (long)sizeof(frame_hdr_t)) {
+            // the connection buffer goes with the frame
+            mqsub_batch_t *own = heap_pool_get(&t->split_pool);
+            if (!own && (own = calloc(1, sizeof(*own)))) {
+                own->pool = &t->split_pool;
+            }
+            if (!own) {
+                perror("[SUB] calloc");
+                recycle_recv_buffer(t, bid);
+                return -1;
+            }
+            long used = parse_frames(t, conn, conn->buf, conn->len, &count);
+            char *buf = own->heap;
+            size_t cap = own->heap_cap;
+            own->heap = conn->buf;
+            own->heap_cap = conn->cap;
+            conn->buf = buf;
+            conn->cap = cap;
+            conn->len = 0;
+            if (used < 0) {
+                mqsub_release(own);
+                recycle_recv_buffer(t, bid);
+                return -1;
+            }
+            if (count) {
+                deliver(t, own, count);
+            } else {
+                mqsub_release(own); //a duplicate
+            }
+            count = 0;
+        }
+    }
+
+    long used = parse_frames(t, conn, data, n, &count);
+    if (used >= 0 && (size_t)used < n) {
+        long want = n - used >= sizeof(frame_hdr_t) ? frame_size(data + used) : (long)(n - used);
+        if (want < 0 || conn_reserve(conn, want) < 0) {
+            used = -1;
+        } else {
+            memcpy(conn->buf, data + used, n - used);
+            conn->len = n - used;
+        }
+    }
+    if (used < 0 || !count) {
+        recycle_recv_buffer(t, bid);
+        return used < 0 ? -1 : 0;
+    }
+    deliver(t, &t->batches[bid], count);
+    return 0;
+}
+
+// Drop what the connection holds. Its recv is keyed by the fd number
+// alone, so while it is still armed (more) the fd must stay open or a
+// connection that reuses the number would get its completions: the recv
+// is cancelled and the fd closed on its last completion
+static void close_conn(recv_thread_t *t, int fd, int more) {
+    free(conns[fd].buf);
+    conns[fd].buf = NULL;
+    conns[fd].len = 0;
+    conns[fd].cap = 0;
+    conns[fd].log_slot = 0;
+    conns[fd].repair_left = 0;
+    if (conns[fd].shm) {
+        shm_reader_t *r = conns[fd].shm;
+        conns[fd].shm = NULL;
+        atomic_store(&r->stop, 1);
+        syscall(SYS_futex, &r->ring->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    if (more) {
+        struct io_uring_sqe *sqe = recv_sqe(t);
+        io_uring_prep_cancel64(sqe, EV_DATA(TYPE_READ, fd), 0);
+        io_uring_sqe_set_data64(sqe, EV_DATA(TYPE_CANCEL, fd));
+        conns[fd].closing = 1;
+        return;
+    }
+    conns[fd].closing = 0;
+    register_file(t, fd, -1);
+    close(fd);
+}
+
+// One multishot accept and one multishot recv per publisher stay armed,
+// receives land in the provided buffers. Completions are reaped in a batch
+// and whatever they re-armed goes out with the next submit_and_wait
+static void *receive_loop(void *arg) {
+    recv_thread_t *t = arg;
+    int sock = t->listen_fd;
+    t->thread = pthread_self();
+    if (t->ring.flags & IORING_SETUP_R_DISABLED) {
+        int ret = io_uring_enable_rings(&t->ring);
+        if (ret < 0) {
+            fprintf(stderr, "[SUB] io_uring_enable_rings: %s\n", strerror(-ret));
+            return NULL;
+        }
+    }
+    add_accept_request(t, sock);
+    add_wake_request(t);
+
+    while (1) {
+        collect_returned(t);
+        int ret = io_uring_submit_and_wait(&t->ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "[SUB] io_uring_submit_and_wait: %s\n", strerror(-ret));
+            return NULL;
+        }
+
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        unsigned seen = 0;
+        io_uring_for_each_cqe(&t->ring, head, cqe) {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            int type = data >> 32;
+            int fd = (uint32_t)data;
+            int result = cqe->res;
+            int more = cqe->flags & IORING_CQE_F_MORE;
+            seen++;
+
+            switch (type) {
+                case TYPE_ACCEPT:
+                    if (!more) {
+                        add_accept_request(t, sock);
+                    }
+                    if (result < 0) {
+                        break;
+                    }
+                    printf("[SUB] Accepted client FD: %d\n", result);
+                    if (result >= MAX_CONNS || register_file(t, result, result) < 0) {
+                        close(result);
+                    } else {
+                        add_read_request(t, result);
+                    }
+                    break;
+                case TYPE_READ:
+                    if (conns[fd].closing) {
+                        // still draining the cancelled recv
+                        if (result > 0) {
+                            recycle_recv_buffer(t, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                        }
+                        if (!more) {
+                            close_conn(t, fd, 0);
+                        }
+                    } else if (result > 0) {
+                        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                        atomic_fetch_add_explicit(&t->reads, 1, memory_order_relaxed);
+                        if (conn_recv(t, &conns[fd], bid, result) < 0) {
+                            atomic_fetch_add(&t->read_err, 1);
+                            close_conn(t, fd, more);
+                        } else if (!more) {
+                            add_read_request(t, fd);
+                        }
+                    } else if (result == -ENOBUFS) {
+                        // the application holds every buffer, wait for one.
+                        // set waiting before looking at returned again
+                        t->starved[t->starved_count++] = fd;
+                        atomic_store(&t->waiting, 1);
+                    } else if (result == 0) {
+                        atomic_fetch_add(&t->closed, 1);
+                        close_conn(t, fd, 0);
+                    } else {
+                        atomic_fetch_add(&t->read_err, 1);
+                        close_conn(t, fd, 0);
+                    }
+                    break;
+                case TYPE_WAKE:
+                    add_wake_request(t);
+                    break;
+                case TYPE_CANCEL:
+                    break; //the recv itself says when it is done
+            }
+        }
+        io_uring_cq_advance(&t->ring, seen);
+    }
+    return NULL;
+}
+
+int mqsub_start(const mqsub_config_t *config) {
+    if (!config->topic || !config->on_batch || config->policy < 0 || config->policy >= BP_COUNT ||
+        config->ring_mode < MQSUB_RING_DEFAULT || config->ring_mode > MQSUB_RING_DEFER ||
+        config->recv_threads < 0 || config->recv_threads > MAX_RECV_THREADS) {
+        fprintf(stderr, "[SUB] bad mqsub config\n");
+        return -1;
+    }
+    bp_policy = config->policy;
+    bp_lag_limit = config->lag_limit;
+    recv_thread_count = config->recv_threads ? config->recv_threads : 1;
+    ring_mode = config->ring_mode;
+    replay_ms = config->replay_ms;
+    shared_memory = config->shared_memory;
+    multicast = config->multicast;
+    on_batch = config->on_batch;
+    on_batch_ctx = config->ctx;
+
+    //generate unique system id
+    subscriber_id = generate_id();
+
+    //initalize topic array
+    subscribed_topics = malloc(TOPIC_CAPACITY * MAX_TOPIC_LEN);
+    if (!subscribed_topics) {
+        perror("[SUB] malloc");
+        return -1;
+    }
+    mqsub_subscribe(config->topic);
+
+    //a ring and a TCP listen socket per receive thread, all on one port
+    recv_threads = calloc(recv_thread_count, sizeof(recv_thread_t));
+    if (!recv_threads) {
+        perror("[SUB] calloc");
+        return -1;
+    }
+    for (int i = 0; i < recv_thread_count; i++) {
+        recv_thread_t *t = &recv_threads[i];
+        if (setup_ring(t) < 0 || setup_recv_buffers(t) < 0) {
+            return -1;
+        }
+        t->listen_fd = setup_listen_socket(&listen_port);
+        t->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (t->listen_fd < 0 || t->wake_fd < 0 || register_file(t, t->listen_fd, t->listen_fd) < 0) {
+            return -1;
+        }
+    }
+
+    static int hb_sock;
+    hb_sock = setup_heartbeat();
+    if (hb_sock < 0) {
+        return -1;
+    }
+    pthread_t hb_thread;
+    pthread_create(&hb_thread, NULL, heartbeat_thread, &hb_sock);
+    for (int i = 0; i < recv_thread_count; i++) {
+        pthread_create(&recv_threads[i].thread, NULL, receive_loop, &recv_threads[i]);
+    }
+    return 0;
+}
+
+void mqsub_wait(void) {
+    for (int i = 0; i < recv_thread_count; i++) {
+        pthread_join(recv_threads[i].thread, NULL);
+    }
+}
+
+void mqsub_stats(mqsub_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int t = 0; t < recv_thread_count; t++) {
+        out->reads  += atomic_load(&recv_threads[t].reads);
+        out->msgs   += atomic_load(&recv_threads[t].msgs);
+        out->errors += atomic_load(&recv_threads[t].read_err);
+        out->closed += atomic_load(&recv_threads[t].closed);
+    }
+    out->msgs += atomic_load(&shm_msgs) + atomic_load(&mcast_msgs);
+    out->gaps = atomic_load(&mcast_gaps);
+    out->lost = atomic_load(&mcast_lost);
+}
@@ -0,0 +1,77 @@
+// mqsub.h
+// subscriber library: heartbeats to the publishers, the topic list and the
+// io_uring receive threads, with messages handed to the application in place
+#ifndef MQSUB_H
+#define MQSUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// what the publisher does when we fall behind, same values as the publisher
+enum { BP_DROP_NEWEST = 0, BP_DROP_OLDEST, BP_BLOCK, BP_DISCONNECT, BP_COUNT };
+
+// how the receive rings run
+enum {
+    MQSUB_RING_DEFAULT = 0,
+    MQSUB_RING_SQPOLL,      // a kernel thread per ring polls for submissions
+    MQSUB_RING_DEFER,       // completions are only processed when the thread waits
+};
+
+// one message, pointing into the receive buffer it arrived in
+typedef struct {
+    const char *topic;
+    size_t topic_len;
+    const char *payload;
+    size_t len;
+    uint64_t seq;               // position in the publisher's log, 0 if it keeps none
+} mqsub_msg_t;
+
+// the receive buffer behind a batch, handed back with mqsub_release
+typedef struct mqsub_batch mqsub_batch_t;
+
+// Called on a receive thread with every message that arrived in one receive
+// buffer. msgs is only valid during the call, the bytes it points to until
+// batch is released. Every batch has to be released once, from any thread.
+// Buffers that are held stop the receive threads from reading more, and
+// ring batches stop a publisher's shared-memory ring from taking more
+typedef void (*mqsub_callback_t)(void *ctx, mqsub_batch_t *batch,
+                                 const mqsub_msg_t *msgs, size_t count);
+
+typedef struct {
+    const char *topic;          // first subscription
+    int policy;                 // BP_*
+    uint32_t lag_limit;         // bytes, 0 for the publisher default
+    int recv_threads;           // 0 for 1
+    int ring_mode;              // MQSUB_RING_*, falls back to default if the kernel lacks it
+    uint32_t replay_ms;         // history to ask a logging publisher for the first time, 0 for none
+    int shared_memory;          // read publishers on this host from their shared-memory ring
+    int multicast;              // join the multicast groups publishers offer for our patterns
+    mqsub_callback_t on_batch;
+    void *ctx;                  // passed to on_batch
+} mqsub_config_t;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t msgs;
+    uint64_t errors;
+    uint64_t closed;
+    uint64_t gaps;              // multicast messages missed and asked for again
+    uint64_t lost;              // of those, the ones that could not be repaired
+} mqsub_stats_t;
+
+// Start beating and receiving in background threads. One subscriber per
+// process. Returns 0, or -1 if it could not be set up
+int mqsub_start(const mqsub_config_t *config);
+
+// Wait for the receive threads, they only stop on a fatal ring error
+void mqsub_wait(void);
+
+int mqsub_subscribe(const char *topic);
+// returns 1 if the topic was subscribed
+int mqsub_unsubscribe(const char *topic);
+
+void mqsub_release(mqsub_batch_t *batch);
+
+void mqsub_stats(mqsub_stats_t *out);
+
+#endif
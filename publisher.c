@@ -1,5 +1,6 @@
 // publisher.c
 // publish messages to correct topics
+#define _GNU_SOURCE // recvmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,90 +14,2111 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdatomic.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <endian.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <liburing.h>
+
+#define DEFAULT_MAX_SUBS 65536 // -n, rounded up to a whole SUB_CHUNK
+#define SUB_CHUNK 64 // registry grows this many slots at a time, one bitmap word
+#define MAX_TOPIC_LEN 64
+#define TOPIC_CAPACITY 16 // default topics per subscriber, -t
+#define MAX_TOPIC_CAPACITY 255 // -t limit, heartbeats count topics in a byte
+#define HB_MAX_SIZE 1472 // heartbeat datagram, fits one unfragmented packet
+#define HB_BATCH 64 // heartbeats drained per recvmmsg
+#define HB_RCVBUF (4 << 20) // heartbeat socket receive buffer, rides out bursts
+#define MAX_BUFFER_SIZE 1024
+#define DEFAULT_PORT 5555
+#define MICROSERVICE_PORT 4444
+#define HEARTBEAT_PORT 5554
+#define SUBSCRIBER_TIMEOUT 10 
+#define WHEEL_TICK_MS 100 // heartbeat expiry resolution
+#define WHEEL_BITS 6 // 64 buckets per timer wheel level
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define SUB_USER_TIMEOUT_MS 5000 // unacked data or failed keepalives before the kernel drops a subscriber
+#define SUB_KEEPIDLE 5 // seconds idle before the first keepalive probe
+#define SUB_KEEPCNT 3 // probes, one a second
+#define SUB_QUEUE_DEPTH 1024 // outbound messages per subscriber, power of 2
+#define SENDER_THREADS 2
+#define FLUSH_IOV 64 // frames coalesced into one sendmsg
+#define BATCH_MAX_BYTES (64 << 10) // -b default, queued bytes that go out without waiting for -d
+#define INGEST_BUFFERS 64 // microservice receive buffers, power of 2
+#define INGEST_BUFFER_SIZE 65536
+#define SENDER_EVENTS 256 // epoll events per sender wakeup
+#define DEFAULT_LAG_LIMIT (4 << 20) // bytes queued + unsent in the kernel before the policy kicks in
+#define LOG_SEGMENT_SIZE (64 << 20) // -l, bytes per mmap'd log file
+#define LOG_SEGMENTS 16 // log files kept, the oldest is deleted on rotation
+#define LOG_MAX_SEGMENTS (LOG_SEGMENTS * 4) // kept while replays hold off deletion
+#define LOG_INDEX_EVERY 65536 // log bytes between sparse index entries
+#define LOG_TOPIC_BUCKETS 4096 // per-topic sequence counters
+#define LOG_SCAN_MAX (1 << 20) // log bytes a replay looks through per send
+#define LVC_BUCKETS 4096 // last-value cache hash buckets
+#define LVC_MAX_TOPICS 65536 // topics whose last message is kept
+#define SHM_RING_SIZE (64 << 20) // -s, shared-memory ring bytes, power of 2
+#define SHM_READERS 64 // same-host subscribers on the ring, one bitmap word
+#define SHM_MAGIC 0x6d717368 // "mqsh"
+#define MCAST_GROUPS 8 // -g, multicast groups, bit per group in a subscriber
+#define MCAST_HISTORY 4096 // messages per group kept for repairs, power of 2
+#define MCAST_REPAIR_MAX 1024 // messages sent for one repair request
+
+// Heartbeat, subscriber -> publisher (UDP), all fields network order.
+// HB_PING is only this header and says the subscriber is alive with topic
+// list version epoch. HB_FULL carries the whole list and HB_DELTA the
+// changes from epoch - 1, as count records of
+//   uint8 op (HB_ADD/HB_REMOVE), uint8 length, topic bytes (no NUL).
+// a publisher that can't apply a beat answers with an HB_NAK header and the
+// subscriber sends HB_FULL.
+// HB_FULL may also hold HB_RESUME records (length 12): uint32 log_id,
+// uint64 seq, asking a publisher with that log to replay it from seq on.
+// log_id 0 makes seq a unix time in ms, for a log the subscriber has not seen
+// flags has HB_F_SHM when the subscriber can read a shared-memory ring,
+// HB_F_MCAST when it can join multicast groups.
+// HB_REPAIR is the header and an mcast_repair_t, asking a publisher to
+// resend multicast messages the subscriber missed over its TCP stream
+#define HB_VERSION 2
+#define HB_F_SHM 1
+#define HB_F_MCAST 2
+enum { HB_PING = 0, HB_FULL, HB_DELTA, HB_NAK, HB_REPAIR };
+enum { HB_ADD = 0, HB_REMOVE, HB_RESUME };
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;     // HB_VERSION
+    uint8_t type;        // HB_*
+    uint8_t policy;      // backpressure policy, BP_*
+    uint8_t count;       // topic records that follow
+    uint32_t system_id;
+    uint32_t epoch;      // topic list version, bumped on every change
+    uint32_t lag_limit;  // bytes, 0 for the publisher default
+    uint16_t advertised_port;
+    uint16_t flags;      // HB_F_*
+    uint64_t timestamp; // Time when the heartbeat was sent
+} heartbeat_t;
+
+// what to do when a subscriber falls lag_limit bytes behind
+enum {
+    BP_DROP_NEWEST = 0, // drop new messages for it until it catches up
+    BP_DROP_OLDEST,     // keep the newest, drop its oldest unsent frames
+    BP_BLOCK,           // hold up the fan-out until it has room
+    BP_DISCONNECT,      // evict it
+    BP_COUNT
+};
+
+static const char *bp_names[BP_COUNT] = { "drop-newest", "drop-oldest", "block", "disconnect" };
+
+// Stream framing, publisher -> subscriber. Each message on the TCP stream is
+// this header (network order), then a frame_seq_t if flags has FRAME_SEQ,
+// then topic_len topic bytes, then len payload bytes.
+// FRAME_SHM moves a subscriber to the shared-memory ring: the topic is the
+// ring's shm name and the payload its uint32 reader slot, messages stop
+// coming on the stream and are read from the ring from then on.
+// FRAME_MCAST moves the topic it names to a multicast group, the payload
+// is an mcast_offer_t. FRAME_REPAIR (the group's pattern, an mcast_repaired_t)
+// answers an HB_REPAIR, the group's messages it names follow it on the stream
+#define FRAME_SEQ 1
+#define FRAME_SHM 2
+#define FRAME_MCAST 4
+#define FRAME_REPAIR 8
+typedef struct __attribute__((packed)) {
+    uint32_t len;        // payload length
+    uint16_t topic_len;
+    uint16_t flags;      // FRAME_*
+} frame_hdr_t;
+
+// where a logged message sits in the publisher's log
+typedef struct __attribute__((packed)) {
+    uint64_t seq;        // from 1, every message in the log
+    uint32_t log_id;     // changes whenever the publisher starts a new log
+    uint32_t topic_seq;  // from 1, messages on this topic in the log
+} frame_seq_t;
+
+// Multicast datagram, publisher -> group: this header then one frame
+// (no FRAME_SEQ), all network order
+typedef struct __attribute__((packed)) {
+    uint32_t source;     // publisher, random per run
+    uint16_t group;      // index in its -g list
+    uint16_t reserved;
+    uint64_t seq;        // from 1, every message on the group
+    uint64_t lvc_gen;    // last-value generation of the message, 0 for none
+} mcast_hdr_t;
+
+// FRAME_MCAST payload, where to read a group and the first seq that is ours
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t port;
+    uint32_t addr;       // group address
+    uint32_t iface;      // address the publisher sends from, 0 for any
+    uint64_t next_seq;
+    uint64_t lvc_gen;    // values up to this generation came in the snapshot
+} mcast_offer_t;
+
+// HB_REPAIR body, seq from..to of group are missing
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t reserved;
+    uint64_t from;
+    uint64_t to;
+} mcast_repair_t;
+
+// FRAME_REPAIR payload. Of seq asked..to, the ones before kept are no longer
+// in the history, kept..to follow in order
+typedef struct __attribute__((packed)) {
+    uint32_t source;
+    uint16_t group;
+    uint16_t reserved;
+    uint64_t asked;
+    uint64_t kept;
+    uint64_t to;
+} mcast_repaired_t;
+
+// one framed message, shared by every subscriber queue it is in
+typedef struct {
+    _Atomic int refs;
+    uint32_t len;   // whole frame, header included
+    char data[];
+} out_msg_t;
+
+// single producer (routing loop) / single consumer (sender worker) ring
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head; // next slot the router fills
+    _Atomic uint64_t pushed_bytes;      // router side byte count
+    _Alignas(64) _Atomic uint32_t tail; // next slot the sender drains
+    _Atomic uint64_t popped_bytes;      // sender side byte count
+    uint32_t sent;                      // bytes of the tail message already sent
+    uint64_t replay_pos;                // sender side, log replay that goes out before msgs
+    uint64_t replay_end;
+    uint64_t replay_run;                // end of the matching records being sent
+    const char *replay_at;              // bytes at replay_pos
+    char **replay_topics;               // subscription when the replay started
+    _Atomic int replaying;              // until the replay catches up, the router drops
+                                        // instead of applying the policy, the log has them
+    int replay_topic_count;
+    char *snapshot;                     // sender side, last values that go out first
+    uint32_t snapshot_len;
+    uint32_t snapshot_sent;
+    _Atomic(struct repair *) repairs;   // multicast repairs, heartbeat thread -> sender
+    out_msg_t *msgs[SUB_QUEUE_DEPTH];
+} sub_queue_t;
+
+// slot lifecycle. the router only queues to ACTIVE slots, the cleanup thread
+// marks a slot CLOSING and its sender worker closes the socket and frees it
+enum { SUB_FREE = 0, SUB_ACTIVE, SUB_CLOSING };
+
+typedef struct {
+    int tcp_sock;  // TCP socket file descriptor
+    _Atomic int state;
+    uint32_t ip_addr;
+    uint16_t port;
+    uint32_t subscriber_id; 
+    char **entries;    // topic list as the subscriber sent it
+    int entry_count;
+    uint32_t epoch;    // version of that list
+    char **topics;     // entries expanded into topic_count patterns
+    int topic_count;
+    int topic_received;
+    int hash_next;     //next slot in its sub_hash bucket, heartbeat thread only
+    int hash_bucket;   //bucket it is linked in, -1 for none
+    _Atomic uint64_t last_heartbeat; //healthcheck, wheel tick of its last beat
+    int timer_next;         //timer wheel bucket links, under subs_lock
+    int timer_prev;
+    int *timer_bucket;      //bucket it is in, NULL for none
+    uint64_t timer_due;     //tick it is filed under
+    _Atomic int scheduled;  //on its sender's ready list
+    int ready_next;         //next slot on that list
+    int blocked;            //sender side, socket full (or reactor send in flight)
+    int watched;            //sender side, socket is in the sender's epoll set (reactor: hangup poll armed)
+    int release_armed;      //sender side, waiting for the router to move on
+    uint64_t release_epoch;
+    int policy;             //BP_*, set when it connects
+    uint32_t lag_limit;
+    _Atomic uint64_t dropped;   //messages lost to backpressure
+    _Atomic uint64_t lag_bytes; //queued + kernel send queue, last time it was full
+    _Atomic uint64_t max_lag;
+    uint64_t batch_due;        //sender side, -d deadline of the frames being held, 0 when none are
+    int batch_held;            //sender side, on its sender's (or the reactor's) held list
+    uint64_t lvc_gen;          //its snapshot has every value up to this generation, set
+                               //with the snapshot, the router skips those messages
+    int shm_slot;              //reader slot in the shared-memory ring, -1 when it reads TCP
+    uint32_t mcast_groups;     //groups it reads instead of TCP, set in a table write section
+    sub_queue_t queue; //outbound messages
+} subscriber_t;
+
+// a list of slots a sender comes back to
+typedef struct {
+    int *slots;
+    int count;
+    int cap;
+} deferred_t;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int event_fd;          //router wakes the worker when it queues
+    int epoll_fd;          //eventfd, timer_fd plus the sockets of its full subscribers
+    int timer_fd;          //goes off at the first deadline of held
+    uint64_t timer_due;    //what it is set for, 0 when it is not
+    deferred_t held;       //slots holding frames back for a fuller batch
+    _Atomic int ready;     //slots with work, linked through ready_next, -1 when empty
+    _Atomic int sleeping;
+} sender_t;
+
+// one microservice recv(), handed to the routing loop by pointer
+typedef struct {
+    uint32_t len;
+    char data[INGEST_BUFFER_SIZE];
+} ingest_buf_t;
+
+// bounded lock-free MPMC ring (per-cell sequence numbers), used as
+// ingest -> router hand-off and to return free buffers to ingest
+typedef struct {
+    _Atomic uint32_t seq;
+    ingest_buf_t *buf;
+} ingest_cell_t;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t enqueue_pos;
+    _Alignas(64) _Atomic uint32_t dequeue_pos;
+    ingest_cell_t cells[INGEST_BUFFERS];
+} ingest_ring_t;
+
+typedef struct {
+    int socket; //publisher socket
+} subs_t;
+
+// Subscriber registry
+// slots live in SUB_CHUNK sized chunks that are allocated as subscribers
+// arrive and never freed, so a slot number stays valid for lock-free readers.
+// sub_slots only grows, freed slots are reused before a new chunk is added
+static _Atomic(subscriber_t *) *sub_chunks; // max_subs / SUB_CHUNK entries
+static _Atomic int sub_slots;               // slots allocated so far
+static int max_subs = DEFAULT_MAX_SUBS;
+static int max_topics = TOPIC_CAPACITY;     // per subscriber
+static int sub_words;                       // max_subs / 64, bitmap width
+static int sender_count = SENDER_THREADS;   // 1 in reactor mode
+pthread_mutex_t subs_lock = PTHREAD_MUTEX_INITIALIZER; //serializes writers of the subs list
+static _Atomic uint32_t subs_seq;     //seqlock for readers of the subs list, odd while a write is in progress
+static _Atomic uint64_t router_epoch; //bumped by the routing loop between batches
+static sender_t senders[SENDER_THREADS];
+// (ip, port, system_id) -> slot, chained through hash_next. Only the heartbeat
+// thread (or the reactor) links and unlinks, so it looks up without a lock.
+// a released slot stays linked until it is reused, its key no longer matches
+static int *sub_hash;
+static uint32_t sub_hash_mask;
+static int *free_slots;  //stack of SUB_FREE slots, under subs_lock
+static int free_count;
+// heartbeat expiry, a two level timer wheel of WHEEL_TICK_MS ticks under
+// subs_lock. A slot is filed at last_heartbeat + the timeout and a beat only
+// stores its tick, the slot is moved when its bucket comes up
+static int wheel[2][WHEEL_SIZE];  //bucket heads, linked through timer_next
+static uint64_t wheel_now;        //last tick processed
+static uint64_t batch_delay_ns;          // -d, 0 sends as soon as a sender gets to it
+static uint32_t batch_bytes = BATCH_MAX_BYTES; // -b
+static _Atomic uint64_t batch_full;      // held batches sent for reaching batch_bytes
+static _Atomic uint64_t batch_expired;   // and for reaching their deadline
+static _Atomic uint64_t pub_success   = 0; 
+static _Atomic uint64_t pub_error  = 0; 
+
+
+int microservice_fd = -1;
+static ingest_ring_t ingest_ready;  //filled buffers, microservice thread -> routing loop
+static ingest_ring_t ingest_free;   //empty buffers back to the microservice thread
+static int ingest_event_fd = -1;    //wakes the routing loop when it is idle
+static _Atomic int router_sleeping;
+static int reactor_mode = 0; //single io_uring thread instead of worker threads
+static int heartbeat_fd = -1; //UDP heartbeat socket, NAKs go out on it too
+
+static inline subscriber_t *sub_at(int slot) {
+    subscriber_t *chunk = atomic_load_explicit(&sub_chunks[slot / SUB_CHUNK],
+                                               memory_order_acquire);
+    return &chunk[slot % SUB_CHUNK];
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t wheel_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK_MS;
+}
+
+// File a slot to come up at tick due. Called with subs_lock held
+static void wheel_insert(int slot, uint64_t due) {
+    subscriber_t *sub = sub_at(slot);
+    if (due <= wheel_now) {
+        due = wheel_now + 1;
+    }
+    // level 1 covers WHEEL_SIZE - 1 more turns of level 0, farther deadlines
+    // are filed at its end and come back around
+    if (due - wheel_now > (uint64_t)(WHEEL_SIZE - 1) * WHEEL_SIZE) {
+        due = wheel_now + (uint64_t)(WHEEL_SIZE - 1) * WHEEL_SIZE;
+    }
+    int *head = due - wheel_now < WHEEL_SIZE
+        ? &wheel[0][due & (WHEEL_SIZE - 1)]
+        : &wheel[1][(due >> WHEEL_BITS) & (WHEEL_SIZE - 1)];
+    sub->timer_due = due;
+    sub->timer_bucket = head;
+    sub->timer_prev = -1;
+    sub->timer_next = *head;
+    if (*head >= 0) {
+        sub_at(*head)->timer_prev = slot;
+    }
+    *head = slot;
+}
+
+static void wheel_unlink(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    if (!sub->timer_bucket) {
+        return;
+    }
+    if (sub->timer_prev >= 0) {
+        sub_at(sub->timer_prev)->timer_next = sub->timer_next;
+    } else {
+        *sub->timer_bucket = sub->timer_next;
+    }
+    if (sub->timer_next >= 0) {
+        sub_at(sub->timer_next)->timer_prev = sub->timer_prev;
+    }
+    sub->timer_bucket = NULL;
+}
+
+// Add a chunk of free slots. Called with subs_lock held.
+// Returns -1 when max_subs is reached
+static int sub_grow(void) {
+    int first = atomic_load(&sub_slots);
+    if (first >= max_subs) {
+        return -1;
+    }
+    subscriber_t *chunk = calloc(SUB_CHUNK, sizeof(subscriber_t));
+    if (!chunk) {
+        perror("subscriber chunk calloc");
+        return -1;
+    }
+    for (int i = 0; i < SUB_CHUNK; i++) {
+        chunk[i].tcp_sock = -1;
+        chunk[i].hash_bucket = -1;
+        chunk[i].shm_slot = -1;
+    }
+    atomic_store_explicit(&sub_chunks[first / SUB_CHUNK], chunk, memory_order_release);
+    atomic_store_explicit(&sub_slots, first + SUB_CHUNK, memory_order_release);
+    // lowest slot on top
+    for (int i = SUB_CHUNK - 1; i >= 0; i--) {
+        free_slots[free_count++] = first + i;
+    }
+    return 0;
+}
+
+// Take a free slot. Called with subs_lock held, -1 when the table is full
+static int sub_alloc(void) {
+    if (!free_count && sub_grow() < 0) {
+        return -1;
+    }
+    return free_slots[--free_count];
+}
+
+static inline uint32_t sub_hash_key(uint32_t ip, uint16_t port, uint32_t id) {
+    uint64_t k = ((uint64_t)ip << 32 | id) ^ ((uint64_t)port << 16);
+    k *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(k >> 32) & sub_hash_mask;
+}
+
+static int sub_lookup(uint32_t ip, uint16_t port, uint32_t id) {
+    for (int i = sub_hash[sub_hash_key(ip, port, id)]; i >= 0; ) {
+        subscriber_t *sub = sub_at(i);
+        if (sub->ip_addr == ip && sub->port == port && sub->subscriber_id == id) {
+            return i;
+        }
+        i = sub->hash_next;
+    }
+    return -1;
+}
+
+static void sub_hash_unlink(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    if (sub->hash_bucket < 0) {
+        return;
+    }
+    for (int *link = &sub_hash[sub->hash_bucket]; *link >= 0; link = &sub_at(*link)->hash_next) {
+        if (*link == slot) {
+            *link = sub->hash_next;
+            break;
+        }
+    }
+    sub->hash_bucket = -1;
+}
+
+// link a slot under its new key, dropping whatever it was linked under before
+static void sub_hash_insert(int slot, uint32_t ip, uint16_t port, uint32_t id) {
+    subscriber_t *sub = sub_at(slot);
+    uint32_t b = sub_hash_key(ip, port, id);
+    sub_hash_unlink(slot);
+    sub->hash_next = sub_hash[b];
+    sub->hash_bucket = b;
+    sub_hash[b] = slot;
+}
+
+int connect_to_subscriber(uint32_t ip_addr, uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in sub_addr;
+    memset(&sub_addr, 0, sizeof(sub_addr));
+    sub_addr.sin_family = AF_INET;
+    sub_addr.sin_port = htons(port);
+    sub_addr.sin_addr.s_addr = ip_addr;
+
+    if (connect(sock, (struct sockaddr *)&sub_addr, sizeof(sub_addr)) < 0) {
+        perror("connect to subscriber");
+        close(sock);
+        return -1;
+    }
+    // notice a dead peer in seconds, not after the heartbeat timeout.
+    // keepalive covers an idle connection, the user timeout one with unacked data
+    int on = 1, idle = SUB_KEEPIDLE, intvl = 1, cnt = SUB_KEEPCNT;
+    unsigned int user_timeout = SUB_USER_TIMEOUT_MS;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+    setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    // batching is ours (-d/-b), Nagle would only add a round trip on top
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // sender workers never block on a slow subscriber.
+    // the reactor keeps it blocking so io_uring arms poll instead of -EAGAIN
+    if (!reactor_mode) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    }
+
+    return sock;
+}
+// match sub-topics separated by colon. a pattern matches its own topic and
+// everything under it, "*" matches any one segment and a trailing "#"
+// matches its parent and everything under it
+static int topic_matches(const char *published, const char *sub) {
+    const char *p = published;
+    const char *s = sub;
+    while (1) {
+        const char *pend = strchr(p, ':');
+        const char *send = strchr(s, ':');
+        size_t plen = pend ? (size_t)(pend - p) : strlen(p);
+        size_t slen = send ? (size_t)(send - s) : strlen(s);
+
+        if (slen == 1 && *s == '#') {
+            return 1;
+        }
+        if (!(slen == 1 && *s == '*') && (plen != slen || memcmp(p, s, slen) != 0)) {
+            return 0;
+        }
+        if (!send) {
+            return 1; //rest of the published topic is under the pattern
+        }
+        if (!pend) {
+            // "a:#" still matches "a"
+            return strcmp(send + 1, "#") == 0;
+        }
+        p = pend + 1;
+        s = send + 1;
+    }
+}
+
+// Topic routing index
+// trie over colon-separated segments, edges kept in one hash table keyed by
+// (parent, segment). each node has a bitmap of the subscriber slots subscribed
+// at that node. a subscription to "a:b" matches "a:b" and everything under it,
+// so routing a published topic just ORs the bitmaps along its path.
+// wildcard patterns live in the same trie: "*" and "#" are ordinary child
+// segments, and the parent is flagged so the router only looks them up where
+// they exist. routing walks the set of nodes matching each level, so every
+// subscriber's patterns are matched in one pass over the published topic.
+// nodes are never freed, the topic namespace is small and reused.
+// a node's bitmap is only as wide as its highest subscribed slot, so routing
+// cost follows the subscribers of a topic, not the size of the table.
+// changes are made with subs_lock held, inside a subs_seq write section.
+// the routing loop reads it with no lock: nodes and bitmaps are published
+// with release stores, member words are atomics, and subs_seq tells it to
+// retry when a change raced with its walk.
+#define TOPIC_INDEX_BUCKETS 4096
+#define WILD_STAR 1 // node has a "*" child
+#define WILD_HASH 2 // node has a "#" child
+
+typedef struct member_set {
+    uint32_t words;
+    struct member_set *retired;      // smaller set it replaced
+    _Atomic uint64_t bits[];         // bit per subscriber slot
+} member_set_t;
+
+typedef struct topic_node {
+    struct topic_node *parent;
+    _Atomic(struct topic_node *) hash_next;  // bucket chain
+    uint32_t hash;
+    uint32_t seg_len;
+    _Atomic(member_set_t *) members;
+    _Atomic int wild;                        // WILD_* children
+    char seg[];
+} topic_node_t;
+
+static topic_node_t topic_root;
+static _Atomic(topic_node_t *) topic_buckets[TOPIC_INDEX_BUCKETS];
+static uint64_t *route_targets;  // router scratch, sub_words wide, kept zeroed
+static uint32_t *route_touched;  // words of route_targets in use
+static topic_node_t **route_level[2]; // router scratch, nodes matching a level
+static int route_level_cap;
+
+static uint32_t topic_edge_hash(const topic_node_t *parent, const char *seg, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)seg[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static topic_node_t *topic_child(topic_node_t *parent, const char *seg, size_t len, int create) {
+    uint32_t h = topic_edge_hash(parent, seg, len);
+    _Atomic(topic_node_t *) *bucket = &topic_buckets[h % TOPIC_INDEX_BUCKETS];
+    topic_node_t *first = atomic_load_explicit(bucket, memory_order_acquire);
+
+    for (topic_node_t *n = first; n;
+         n = atomic_load_explicit(&n->hash_next, memory_order_acquire)) {
+        if (n->hash == h && n->parent == parent && n->seg_len == len &&
+            memcmp(n->seg, seg, len) == 0) {
+            return n;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    topic_node_t *n = calloc(1, sizeof(*n) + len + 1);
+    if (!n) {
+        perror("topic index calloc");
+        return NULL;
+    }
+    n->parent = parent;
+    n->hash = h;
+    n->seg_len = len;
+    memcpy(n->seg, seg, len);
+    atomic_init(&n->hash_next, first);
+    atomic_store_explicit(bucket, n, memory_order_release);
+    if (len == 1 && (*seg == '*' || *seg == '#')) {
+        atomic_fetch_or_explicit(&parent->wild, *seg == '*' ? WILD_STAR : WILD_HASH,
+                                 memory_order_release);
+    }
+    return n;
+}
+
+// walk (and optionally build) the path for a topic
+static topic_node_t *topic_index_lookup(const char *topic, int create) {
+    topic_node_t *node = &topic_root;
+    const char *seg = topic;
+    while (node) {
+        const char *end = strchr(seg, ':');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+        node = topic_child(node, seg, len, create);
+        if (!end) {
+            break;
+        }
+        seg = end + 1;
+    }
+    return node;
+}
+
+// make a node's bitmap wide enough for slot. the old set is copied, then
+// kept on the retired chain since the router may still be reading it
+static member_set_t *member_set_reserve(topic_node_t *node, int slot) {
+    member_set_t *old = atomic_load_explicit(&node->members, memory_order_relaxed);
+    uint32_t need = slot / 64 + 1;
+    if (old && old->words >= need) {
+        return old;
+    }
+    uint32_t words = old ? old->words * 2 : 1;
+    while (words < need) {
+        words *= 2;
+    }
+    if (words > (uint32_t)sub_words) {
+        words = sub_words;
+    }
+    member_set_t *set = calloc(1, sizeof(*set) + words * sizeof(uint64_t));
+    if (!set) {
+        perror("topic index calloc");
+        return NULL;
+    }
+    set->words = words;
+    set->retired = old;
+    for (uint32_t w = 0; old && w < old->words; w++) {
+        atomic_init(&set->bits[w], atomic_load_explicit(&old->bits[w], memory_order_relaxed));
+    }
+    atomic_store_explicit(&node->members, set, memory_order_release);
+    return set;
+}
+
+static void topic_index_add(const char *topic, int slot) {
+    if (!topic[0]) {
+        return;
+    }
+    topic_node_t *node = topic_index_lookup(topic, 1);
+    member_set_t *set = node ? member_set_reserve(node, slot) : NULL;
+    if (set) {
+        atomic_fetch_or_explicit(&set->bits[slot / 64], 1ULL << (slot % 64),
+                                 memory_order_relaxed);
+    }
+}
+
+static void topic_index_remove(const char *topic, int slot) {
+    if (!topic[0]) {
+        return;
+    }
+    topic_node_t *node = topic_index_lookup(topic, 0);
+    member_set_t *set = node ? atomic_load_explicit(&node->members, memory_order_relaxed) : NULL;
+    if (set && (uint32_t)slot / 64 < set->words) {
+        atomic_fetch_and_explicit(&set->bits[slot / 64], ~(1ULL << (slot % 64)),
+                                  memory_order_relaxed);
+    }
+}
+
+// OR one node's subscribers into route_targets
+static int topic_index_collect(topic_node_t *node, int touched) {
+    member_set_t *set = atomic_load_explicit(&node->members, memory_order_acquire);
+    for (uint32_t w = 0; set && w < set->words; w++) {
+        uint64_t bits = atomic_load_explicit(&set->bits[w], memory_order_relaxed);
+        if (!bits) {
+            continue;
+        }
+        if (!route_targets[w]) {
+            route_touched[touched++] = w;
+        }
+        route_targets[w] |= bits;
+    }
+    return touched;
+}
+
+// room for count nodes in each route_level buffer
+static int topic_index_level_reserve(int count) {
+    if (count <= route_level_cap) {
+        return 1;
+    }
+    int cap = route_level_cap ? route_level_cap * 2 : 64;
+    while (cap < count) {
+        cap *= 2;
+    }
+    for (int l = 0; l < 2; l++) {
+        topic_node_t **grown = realloc(route_level[l], cap * sizeof(topic_node_t *));
+        if (!grown) {
+            perror("topic index realloc");
+            return 0;
+        }
+        route_level[l] = grown;
+    }
+    route_level_cap = cap;
+    return 1;
+}
+
+// collect every slot with a pattern matching the published topic into
+// route_targets: subscriptions to the topic or one of its parents, "*" for
+// any segment on the way and "#" under any node on the way.
+// returns how many words were set, listed in route_touched.
+// the caller clears them with topic_index_route_done
+static int topic_index_route(const char *topic) {
+    int touched = 0;
+    if (!topic_index_level_reserve(1)) {
+        return 0;
+    }
+    topic_node_t **cur = route_level[0];
+    int count = 1;
+    cur[0] = &topic_root;
+
+    const char *seg = topic;
+    while (count) {
+        const char *end = strchr(seg, ':');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+        if (!topic_index_level_reserve(count * 2)) {
+            break;
+        }
+        cur = route_level[0];
+        topic_node_t **next = route_level[1];
+        int next_count = 0;
+
+        for (int i = 0; i < count; i++) {
+            topic_node_t *node = cur[i];
+            int wild = atomic_load_explicit(&node->wild, memory_order_acquire);
+            topic_node_t *child;
+            if ((wild & WILD_HASH) && (child = topic_child(node, "#", 1, 0))) {
+                touched = topic_index_collect(child, touched);
+            }
+            if ((child = topic_child(node, seg, len, 0))) {
+                touched = topic_index_collect(child, touched);
+                next[next_count++] = child;
+            }
+            if ((wild & WILD_STAR) && !(len == 1 && *seg == '*') &&
+                (child = topic_child(node, "*", 1, 0))) {
+                touched = topic_index_collect(child, touched);
+                next[next_count++] = child;
+            }
+        }
+
+        route_level[0] = next;
+        route_level[1] = cur;
+        count = next_count;
+        if (!end) {
+            break;
+        }
+        seg = end + 1;
+    }
+
+    // a trailing "#" also matches the node it hangs off
+    for (int i = 0; i < count; i++) {
+        topic_node_t *node = route_level[0][i];
+        topic_node_t *child;
+        if ((atomic_load_explicit(&node->wild, memory_order_acquire) & WILD_HASH) &&
+            (child = topic_child(node, "#", 1, 0))) {
+            touched = topic_index_collect(child, touched);
+        }
+    }
+    return touched;
+}
+
+static void topic_index_route_done(int touched) {
+    for (int t = 0; t < touched; t++) {
+        route_targets[route_touched[t]] = 0;
+    }
+}
+
+// Subscriber table seqlock
+// writers hold subs_lock and wrap every change the routing loop can see
+// (index membership, slot state) in write_begin/write_end. the routing loop
+// never locks, it redoes its lookup if subs_seq moved underneath it.
+static void table_write_begin(void) {
+    atomic_fetch_add_explicit(&subs_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void table_write_end(void) {
+    atomic_fetch_add_explicit(&subs_seq, 1, memory_order_release);
+}
+
+static uint32_t table_read_begin(void) {
+    uint32_t seq;
+    while ((seq = atomic_load_explicit(&subs_seq, memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+static int table_read_retry(uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&subs_seq, memory_order_relaxed) != seq;
+}
+
+// Outbound queues
+static uint32_t frame_size(uint16_t topic_len, uint32_t len, const frame_seq_t *seq) {
+    return sizeof(frame_hdr_t) + (seq ? sizeof(frame_seq_t) : 0) + topic_len + len;
+}
+
+// frame a message into dst, frame_size bytes. seq is NULL for no FRAME_SEQ
+static void frame_write(char *dst, const char *topic, uint16_t topic_len,
+                        const char *payload, uint32_t len, const frame_seq_t *seq) {
+    uint32_t ext = seq ? sizeof(frame_seq_t) : 0;
+    frame_hdr_t hdr = {
+        .len = htonl(len),
+        .topic_len = htons(topic_len),
+        .flags = htons(seq ? FRAME_SEQ : 0),
+    };
+    memcpy(dst, &hdr, sizeof(hdr));
+    if (seq) {
+        frame_seq_t wire = {
+            .seq = htobe64(seq->seq),
+            .log_id = htonl(seq->log_id),
+            .topic_seq = htonl(seq->topic_seq),
+        };
+        memcpy(dst + sizeof(hdr), &wire, sizeof(wire));
+    }
+    memcpy(dst + sizeof(hdr) + ext, topic, topic_len);
+    memcpy(dst + sizeof(hdr) + ext + topic_len, payload, len);
+}
+
+static out_msg_t *frame_create(const char *topic, uint16_t topic_len,
+                                const char *payload, uint32_t len, int refs,
+                                const frame_seq_t *seq) {
+    uint32_t total = frame_size(topic_len, len, seq);
+    out_msg_t *m = malloc(sizeof(*m) + total);
+    if (!m) {
+        return NULL;
+    }
+    atomic_init(&m->refs, refs);
+    m->len = total;
+    frame_write(m->data, topic, topic_len, payload, len, seq);
+    return m;
+}
+
+static void msg_release(out_msg_t *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        free(m);
+    }
+}
+
+// Message log (-l dir)
+// Every routed message is appended, framed exactly as it goes on the wire,
+// to LOG_SEGMENT_SIZE files that are mmap'd and filled in order. Offsets
+// are logical, counting only record bytes across segments, so a replay is
+// one byte range sent straight out of the mappings. Each segment has a
+// sparse index (seq, offset, time) every LOG_INDEX_EVERY bytes to find
+// where a resume starts. Only the routing loop appends. Senders and the
+// heartbeat thread look segments up under log_lock, and no segment is
+// deleted while a replay is running
+typedef struct {
+    uint64_t seq;      // first record at offset
+    uint64_t offset;
+    uint64_t time_ms;  // wall clock when that record was appended
+} log_index_t;
+
+typedef struct {
+    char *data;        // the mmap'd file
+    uint64_t base;     // logical offset of data[0]
+    uint64_t used;     // record bytes, routing loop only
+    _Atomic uint32_t index_count;
+    log_index_t index[LOG_SEGMENT_SIZE / LOG_INDEX_EVERY + 1];
+    char path[PATH_MAX];
+} log_segment_t;
+
+// messages so far on one topic, routing loop only
+typedef struct topic_seq {
+    struct topic_seq *next;
+    uint32_t seq;
+    uint16_t len;
+    char topic[];
+} topic_seq_t;
+
+static const char *log_dir;       // NULL when not logging
+static uint32_t log_id;
+static log_segment_t *log_segs;   // LOG_MAX_SEGMENTS, a ring from log_first
+static int log_first;
+static int log_count;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; //segment ring and log_readers
+static int log_readers;           // replays in progress
+static _Atomic uint64_t log_end;  // logical offset after the last record
+static uint64_t log_seq;          // last seq handed out, routing loop only
+static _Atomic uint64_t log_skipped; // messages that found no room in the log
+static topic_seq_t *log_topics[LOG_TOPIC_BUCKETS];
+
+static inline log_segment_t *log_seg(int i) {
+    return &log_segs[(log_first + i) % LOG_MAX_SEGMENTS];
+}
+
+static inline uint64_t log_key(const log_index_t *e, int by_time) {
+    return by_time ? e->time_ms : e->seq;
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t log_topic_seq(const char *topic, uint16_t len) {
+    topic_seq_t **bucket = &log_topics[topic_edge_hash(NULL, topic, len) % LOG_TOPIC_BUCKETS];
+    for (topic_seq_t *t = *bucket; t; t = t->next) {
+        if (t->len == len && memcmp(t->topic, topic, len) == 0) {
+            return ++t->seq;
+        }
+    }
+    topic_seq_t *t = malloc(sizeof(*t) + len);
+    if (!t) {
+        return 0;
+    }
+    t->seq = 1;
+    t->len = len;
+    memcpy(t->topic, topic, len);
+    t->next = *bucket;
+    *bucket = t;
+    return 1;
+}
+
+// Start a new segment. The oldest past LOG_SEGMENTS are deleted first,
+// unless a replay may be reading them. Returns -1 when there is no room
+static int log_rotate(void) {
+    pthread_mutex_lock(&log_lock);
+    while (log_count >= LOG_SEGMENTS && log_readers == 0) {
+        log_segment_t *old = log_seg(0);
+        munmap(old->data, LOG_SEGMENT_SIZE);
+        unlink(old->path);
+        old->data = NULL;
+        log_first = (log_first + 1) % LOG_MAX_SEGMENTS;
+        log_count--;
+    }
+    if (log_count == LOG_MAX_SEGMENTS) {
+        pthread_mutex_unlock(&log_lock);
+        return -1;
+    }
+    log_segment_t *seg = log_seg(log_count);
+    uint64_t base = atomic_load(&log_end);
+    snprintf(seg->path, sizeof(seg->path), "%s/%08x-%016llx.log", log_dir, log_id,
+             (unsigned long long)base);
+    char *data = MAP_FAILED;
+    int fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && ftruncate(fd, LOG_SEGMENT_SIZE) == 0) {
+        data = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        perror("[PUB] log segment");
+        if (fd >= 0) {
+            close(fd);
+            unlink(seg->path);
+        }
+        pthread_mutex_unlock(&log_lock);
+        return -1;
+    }
+    close(fd);
+    madvise(data, LOG_SEGMENT_SIZE, MADV_SEQUENTIAL);
+    seg->data = data;
+    seg->base = base;
+    seg->used = 0;
+    atomic_store(&seg->index_count, 0);
+    log_count++;
+    pthread_mutex_unlock(&log_lock);
+    return 0;
+}
+
+// Append a framed message with sequence seq. Routing loop only.
+// Returns -1 if it could not be logged
+static int log_append(const out_msg_t *m, uint64_t seq) {
+    log_segment_t *seg = log_count ? log_seg(log_count - 1) : NULL;
+    if (!seg || seg->used + m->len > LOG_SEGMENT_SIZE) {
+        if (log_rotate() < 0) {
+            atomic_fetch_add(&log_skipped, 1);
+            return -1;
+        }
+        seg = log_seg(log_count - 1);
+    }
+    uint64_t at = seg->base + seg->used;
+    uint32_t n = atomic_load_explicit(&seg->index_count, memory_order_relaxed);
+    if (n == 0 || at - seg->index[n - 1].offset >= LOG_INDEX_EVERY) {
+        seg->index[n] = (log_index_t){ .seq = seq, .offset = at, .time_ms = wall_ms() };
+        atomic_store_explicit(&seg->index_count, n + 1, memory_order_release);
+    }
+    memcpy(seg->data + seg->used, m->data, m->len);
+    seg->used += m->len;
+    // seq_cst, ordered before the router's look at queue.replaying
+    atomic_store(&log_end, at + m->len);
+    return 0;
+}
+
+// Logical offset of the first record with seq >= key (by_time: of the
+// last index entry appended before key ms, so a little earlier than asked).
+// Falls back to the oldest record kept, -1 if there is nothing from key on.
+// Called with log_lock held
+static int64_t log_find(uint64_t key, int by_time) {
+    uint64_t end = atomic_load_explicit(&log_end, memory_order_acquire);
+    if (!log_count) {
+        return -1;
+    }
+    // last segment that starts at or before key
+    int s = 0;
+    for (int i = 1; i < log_count; i++) {
+        log_segment_t *seg = log_seg(i);
+        if (!atomic_load_explicit(&seg->index_count, memory_order_acquire) ||
+            log_key(&seg->index[0], by_time) > key) {
+            break;
+        }
+        s = i;
+    }
+    log_segment_t *seg = log_seg(s);
+    uint32_t n = atomic_load_explicit(&seg->index_count, memory_order_acquire);
+    if (!n || log_key(&seg->index[0], by_time) > key) {
+        return seg->base < end ? (int64_t)seg->base : -1; //key is older than the log
+    }
+    uint32_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (log_key(&seg->index[mid], by_time) <= key) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    uint64_t pos = seg->index[lo].offset;
+    uint64_t seg_end = s + 1 < log_count ? log_seg(s + 1)->base : end;
+    // from the index entry record by record to the exact seq
+    while (!by_time && pos < seg_end) {
+        const char *rec = seg->data + (pos - seg->base);
+        frame_hdr_t hdr;
+        frame_seq_t fs;
+        memcpy(&hdr, rec, sizeof(hdr));
+        memcpy(&fs, rec + sizeof(hdr), sizeof(fs));
+        if (be64toh(fs.seq) >= key) {
+            break;
+        }
+        pos += sizeof(hdr) + sizeof(fs) + ntohs(hdr.topic_len) + ntohl(hdr.len);
+    }
+    return pos < end ? (int64_t)pos : -1;
+}
+
+// Where a new subscriber's replay starts, from the HB_RESUME records of its
+// HB_FULL: the one for our log, else the point in time. Holds off segment
+// deletion (log_readers) when it returns an offset, -1 for no replay
+static int64_t log_resume(const heartbeat_t *hb, int bytes) {
+    const uint8_t *rec = (const uint8_t *)(hb + 1);
+    const uint8_t *end = (const uint8_t *)hb + bytes;
+    int found = 0; //1 for a time, 2 for our log
+    int by_time = 0;
+    uint64_t key = 0;
+    if (!log_dir) {
+        return -1;
+    }
+    for (int r = 0; r < hb->count && end - rec >= 2 && end - rec >= 2 + rec[1]; r++) {
+        if (rec[0] == HB_RESUME && rec[1] == sizeof(uint32_t) + sizeof(uint64_t)) {
+            uint32_t id;
+            uint64_t seq;
+            memcpy(&id, rec + 2, sizeof(id));
+            memcpy(&seq, rec + 2 + sizeof(id), sizeof(seq));
+            if (ntohl(id) == log_id) {
+                key = be64toh(seq);
+                by_time = 0;
+                found = 2;
+            } else if (id == 0 && found < 2) {
+                key = be64toh(seq);
+                by_time = 1;
+                found = 1;
+            }
+        }
+        rec += 2 + rec[1];
+    }
+    if (!found) {
+        return -1;
+    }
+    pthread_mutex_lock(&log_lock);
+    int64_t start = log_find(key, by_time);
+    if (start >= 0) {
+        log_readers++;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return start;
+}
+
+static void log_reader_done(void) {
+    pthread_mutex_lock(&log_lock);
+    log_readers--;
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Find the next run of back to back records in [pos, end) whose topic
+// matches one of topics, in the segment pos is in and at most LOG_SCAN_MAX
+// bytes on. Sets *start and *at to where it begins and returns its end;
+// *start is the returned offset when nothing matched that far
+static uint64_t log_match(uint64_t pos, uint64_t end, char **topics, int count,
+                          uint64_t *start, const char **at) {
+    uint64_t run_end;
+    int in_run = 0;
+    pthread_mutex_lock(&log_lock);
+    int i = 0;
+    while (i + 1 < log_count && log_seg(i + 1)->base <= pos) {
+        i++;
+    }
+    log_segment_t *seg = log_seg(i);
+    uint64_t stop = i + 1 < log_count && log_seg(i + 1)->base < end ? log_seg(i + 1)->base : end;
+    if (stop - pos > LOG_SCAN_MAX) {
+        stop = pos + LOG_SCAN_MAX; //moved to a record boundary below
+    }
+    while (pos < stop) {
+        const char *rec = seg->data + (pos - seg->base);
+        frame_hdr_t hdr;
+        memcpy(&hdr, rec, sizeof(hdr));
+        size_t topic_len = ntohs(hdr.topic_len);
+        const char *name = rec + sizeof(hdr) + sizeof(frame_seq_t);
+        char topic[MAX_TOPIC_LEN + 1];
+        memcpy(topic, name, topic_len);
+        topic[topic_len] = '\0';
+        int match = 0;
+        for (int t = 0; t < count && !match; t++) {
+            match = topic_matches(topic, topics[t]);
+        }
+        if (match != in_run) {
+            if (in_run) {
+                break;
+            }
+            *start = pos;
+            *at = rec;
+            in_run = 1;
+        }
+        pos += sizeof(hdr) + sizeof(frame_seq_t) + topic_len + ntohl(hdr.len);
+    }
+    pthread_mutex_unlock(&log_lock);
+    run_end = pos;
+    if (!in_run) {
+        *start = run_end;
+    }
+    return run_end;
+}
+
+static int log_init(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("[PUB] log directory");
+        return -1;
+    }
+    log_segs = calloc(LOG_MAX_SEGMENTS, sizeof(log_segment_t));
+    if (!log_segs) {
+        perror("[PUB] log calloc");
+        return -1;
+    }
+    // a fresh id per run, subscribers only resume by seq within one log
+    log_id = ((uint32_t)time(NULL) * 2654435761u) ^ ((uint32_t)getpid() << 16);
+    if (!log_id) {
+        log_id = 1;
+    }
+    log_dir = dir;
+    printf("[PUB] Logging messages to %s (log %08x)\n", dir, log_id);
+    return 0;
+}
+
+// Last-value cache
+// the newest frame published on every topic, so a subscriber that connects
+// gets the current value of its topics right away instead of waiting for the
+// next update. entries are keyed by the exact published topic and never
+// freed. only the routing loop writes, copying the frame in under the entry's
+// seqlock. the heartbeat thread copies values out with no lock and redoes one
+// that changed underneath it. a value that outgrows its buffer gets a bigger
+// one, the old one stays on the retired chain since a reader may be copying it
+typedef struct lvc_value {
+    uint32_t cap;
+    uint32_t len;                      // frame bytes
+    uint64_t seq;                      // log seq of the frame, 0 when not logging
+    uint64_t gen;                      // lvc_gen when it was stored
+    struct lvc_value *retired;         // smaller buffer it replaced
+    char data[];
+} lvc_value_t;
+
+typedef struct lvc_entry {
+    struct lvc_entry *hash_next;       // bucket chain, routing loop only
+    _Atomic(struct lvc_entry *) next;  // every entry, newest first
+    _Atomic uint32_t seq;              // odd while the value is being rewritten
+    _Atomic(lvc_value_t *) value;
+    uint16_t topic_len;
+    char topic[];                      // NUL terminated
+} lvc_entry_t;
+
+typedef struct {
+    uint64_t seq;
+    size_t offset;
+    uint32_t len;
+} lvc_item_t;
+
+static lvc_entry_t *lvc_buckets[LVC_BUCKETS];
+static _Atomic(lvc_entry_t *) lvc_all;
+static int lvc_count; // routing loop only
+static uint64_t lvc_gen; // routing loop only, bumped by every store
+
+// routing loop. make a message the current value of its topic.
+// returns its generation, 0 when it could not be kept
+static uint64_t lvc_store(const char *topic, uint16_t topic_len, const char *payload,
+                          uint32_t len, const frame_seq_t *seq) {
+    lvc_entry_t **bucket = &lvc_buckets[topic_edge_hash(NULL, topic, topic_len) % LVC_BUCKETS];
+    lvc_entry_t *e;
+    for (e = *bucket; e; e = e->hash_next) {
+        if (e->topic_len == topic_len && memcmp(e->topic, topic, topic_len) == 0) {
+            break;
+        }
+    }
+    int fresh = !e;
+    if (fresh) {
+        if (lvc_count >= LVC_MAX_TOPICS || !(e = calloc(1, sizeof(*e) + topic_len + 1))) {
+            return 0;
+        }
+        e->topic_len = topic_len;
+        memcpy(e->topic, topic, topic_len);
+        e->hash_next = *bucket;
+        *bucket = e;
+        lvc_count++;
+    }
+
+    uint32_t total = frame_size(topic_len, len, seq);
+    lvc_value_t *v = atomic_load_explicit(&e->value, memory_order_relaxed);
+    if (!v || v->cap < total) {
+        lvc_value_t *grown = malloc(sizeof(*grown) + total);
+        if (!grown) {
+            return 0;
+        }
+        grown->cap = total;
+        grown->retired = v;
+        v = grown;
+    }
+    atomic_fetch_add_explicit(&e->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    frame_write(v->data, topic, topic_len, payload, len, seq);
+    v->len = total;
+    v->seq = seq ? seq->seq : 0;
+    v->gen = ++lvc_gen;
+    atomic_store_explicit(&e->value, v, memory_order_release);
+    atomic_fetch_add_explicit(&e->seq, 1, memory_order_release);
+
+    if (fresh) {
+        atomic_store_explicit(&e->next, atomic_load_explicit(&lvc_all, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(&lvc_all, e, memory_order_release);
+    }
+    return lvc_gen;
+}
+
+// copy an entry's value to *buf + used, growing the buffer as needed.
+// returns the frame length, 0 if there is none
+static uint32_t lvc_read(lvc_entry_t *e, char **buf, size_t *size, size_t used,
+                         uint64_t *seq, uint64_t *gen) {
+    while (1) {
+        uint32_t s = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (s & 1) {
+            sched_yield();
+            continue;
+        }
+        lvc_value_t *v = atomic_load_explicit(&e->value, memory_order_acquire);
+        if (!v) {
+            return 0;
+        }
+        if (used + v->cap > *size) {
+            size_t grown = *size ? *size * 2 : 4096;
+            while (grown < used + v->cap) {
+                grown *= 2;
+            }
+            char *p = realloc(*buf, grown);
+            if (!p) {
+                return 0;
+            }
+            *buf = p;
+            *size = grown;
+        }
+        uint32_t len = v->len < v->cap ? v->len : v->cap; //torn by a rewrite, retried below
+        memcpy(*buf + used, v->data, len);
+        *seq = v->seq;
+        *gen = v->gen;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) == s) {
+            return len;
+        }
+    }
+}
+
+static int lvc_item_cmp(const void *a, const void *b) {
+    uint64_t x = ((const lvc_item_t *)a)->seq, y = ((const lvc_item_t *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+// the current value of every topic matching one of the patterns (the
+// pattern's own topic and everything under it), framed back to back in one
+// buffer. oldest first, a subscriber of a logging publisher drops a seq that
+// is behind one it already took. *gen is the newest generation in it.
+// NULL when nothing matches
+static char *lvc_snapshot(char **topics, int count, uint32_t *out_len, uint64_t *gen) {
+    char *raw = NULL;
+    size_t size = 0, used = 0;
+    lvc_item_t *items = NULL;
+    int n = 0, cap = 0;
+
+    for (lvc_entry_t *e = atomic_load_explicit(&lvc_all, memory_order_acquire); e;
+         e = atomic_load_explicit(&e->next, memory_order_acquire)) {
+        int t = 0;
+        while (t < count && !topic_matches(e->topic, topics[t])) {
+            t++;
+        }
+        if (t == count) {
+            continue;
+        }
+        if (n == cap) {
+            lvc_item_t *grown = realloc(items, (cap ? cap * 2 : 64) * sizeof(*items));
+            if (!grown) {
+                break;
+            }
+            items = grown;
+            cap = cap ? cap * 2 : 64;
+        }
+        uint64_t seq, value_gen;
+        uint32_t len = lvc_read(e, &raw, &size, used, &seq, &value_gen);
+        if (len) {
+            if (value_gen > *gen) {
+                *gen = value_gen;
+            }
+            items[n++] = (lvc_item_t){ .seq = seq, .offset = used, .len = len };
+            used += len;
+        }
+    }
+
+    char *out = n ? malloc(used) : NULL;
+    if (out) {
+        qsort(items, n, sizeof(*items), lvc_item_cmp);
+        size_t at = 0;
+        for (int i = 0; i < n; i++) {
+            memcpy(out + at, raw + items[i].offset, items[i].len);
+            at += items[i].len;
+        }
+        *out_len = used;
+    }
+    free(raw);
+    free(items);
+    return out;
+}
+
+// Shared-memory ring (-s)
+// subscribers on this host read messages straight out of one mmap'd ring
+// instead of the loopback TCP stream. Only the routing loop writes records,
+// each one frame (wire format) behind a header with a bit per reader slot it
+// is for. A reader slot has the tail its subscriber has read up to, and the
+// ring never runs past the slowest one: a message that does not fit is
+// dropped for every reader. Slots belong to connected subscribers, so a
+// reader that goes away is freed with its TCP connection. Readers spin a
+// little, then sleep on the futex word, woken only when someone sleeps
+typedef struct {
+    uint32_t size;     // record bytes, header included, a multiple of 16
+    uint32_t skip;     // filler to the end of the ring
+    uint64_t readers;  // bit per reader slot
+} shm_rec_t;
+
+typedef struct {
+    uint32_t magic;                  // SHM_MAGIC
+    uint32_t size;                   // data bytes, power of 2
+    _Alignas(64) _Atomic uint64_t head;  // bytes written, records below it are complete
+    _Atomic uint32_t futex;          // bumped when head moves under sleepers
+    _Atomic uint32_t sleepers;
+    struct {
+        _Alignas(64) _Atomic uint64_t tail; // read up to here, written by the reader
+    } readers[SHM_READERS];
+    _Alignas(64) char data[];
+} shm_ring_t;
+
+static shm_ring_t *shm_ring;        // NULL when not serving shared memory
+static char shm_name[32];
+static _Atomic uint64_t shm_active; // claimed reader slots, under subs_lock
+static _Atomic uint64_t shm_dropped; // messages the ring had no room for
+
+static int shm_init(void) {
+    snprintf(shm_name, sizeof(shm_name), "/mqpub.%d", (int)getpid());
+    shm_unlink(shm_name);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("[PUB] shm_open");
+        return -1;
+    }
+    size_t bytes = sizeof(shm_ring_t) + SHM_RING_SIZE;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, bytes) == 0) {
+        map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("[PUB] shared memory ring");
+        shm_unlink(shm_name);
+        return -1;
+    }
+    shm_ring = map;
+    shm_ring->size = SHM_RING_SIZE;
+    shm_ring->magic = SHM_MAGIC;
+    printf("[PUB] Same-host subscribers read from shared memory %s\n", shm_name);
+    return 0;
+}
+
+// reader slot for a connecting subscriber, starting at the current head.
+// Called with subs_lock held, -1 when all are taken
+static int shm_claim(void) {
+    uint64_t free_bits = ~atomic_load(&shm_active);
+    if (!free_bits) {
+        return -1;
+    }
+    int slot = __builtin_ctzll(free_bits);
+    atomic_store(&shm_ring->readers[slot].tail, atomic_load(&shm_ring->head));
+    atomic_fetch_or(&shm_active, 1ULL << slot);
+    return slot;
+}
+
+static void shm_release(int slot) {
+    atomic_fetch_and(&shm_active, ~(1ULL << slot));
+}
+
+// routing loop. add a message for the reader slots in readers.
+// returns 0 if it was dropped for lack of room
+static int shm_append(const char *topic, uint16_t topic_len, const char *payload,
+                      uint32_t len, const frame_seq_t *seq, uint64_t readers) {
+    uint32_t need = (sizeof(shm_rec_t) + frame_size(topic_len, len, seq) + 15) & ~15u;
+    uint64_t head = atomic_load_explicit(&shm_ring->head, memory_order_relaxed);
+    uint32_t at = head & (shm_ring->size - 1);
+    uint32_t filler = shm_ring->size - at < need ? shm_ring->size - at : 0;
+
+    uint64_t active = atomic_load(&shm_active);
+    while (active) {
+        int slot = __builtin_ctzll(active);
+        active &= active - 1;
+        uint64_t tail = atomic_load_explicit(&shm_ring->readers[slot].tail, memory_order_acquire);
+        if (head + filler + need - tail > shm_ring->size) {
+            atomic_fetch_add(&shm_dropped, 1);
+            return 0; //the slowest reader still needs that space
+        }
+    }
+    if (filler) {
+        shm_rec_t *pad = (shm_rec_t *)(shm_ring->data + at);
+        pad->size = filler;
+        pad->skip = 1;
+        pad->readers = 0;
+        at = 0;
+    }
+    shm_rec_t *rec = (shm_rec_t *)(shm_ring->data + at);
+    rec->size = need;
+    rec->skip = 0;
+    rec->readers = readers;
+    frame_write((char *)(rec + 1), topic, topic_len, payload, len, seq);
+    atomic_store(&shm_ring->head, head + filler + need);
+    // sleepers is read after head, a reader counts itself before it looks
+    if (atomic_load(&shm_ring->sleepers)) {
+        atomic_fetch_add(&shm_ring->futex, 1);
+        syscall(SYS_futex, &shm_ring->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 1;
+}
+
+// add the frame moving a subscriber to reader slot to the end of its
+// snapshot, so it is read after everything that goes out on the stream
+static int shm_offer(sub_queue_t *q, int slot) {
+    uint16_t name_len = strlen(shm_name);
+    uint32_t total = sizeof(frame_hdr_t) + name_len + sizeof(uint32_t);
+    char *grown = realloc(q->snapshot, q->snapshot_len + total);
+    if (!grown) {
+        return -1;
+    }
+    frame_hdr_t hdr = {
+        .len = htonl(sizeof(uint32_t)),
+        .topic_len = htons(name_len),
+        .flags = htons(FRAME_SHM),
+    };
+    uint32_t wire_slot = htonl(slot);
+    char *at = grown + q->snapshot_len;
+    memcpy(at, &hdr, sizeof(hdr));
+    memcpy(at + sizeof(hdr), shm_name, name_len);
+    memcpy(at + sizeof(hdr) + name_len, &wire_slot, sizeof(wire_slot));
+    q->snapshot = grown;
+    q->snapshot_len += total;
+    return 0;
+}
+
+// Multicast groups (-g pattern@group:port)
+// a subscriber whose pattern is exactly a group's joins the group, and the
+// messages matching that pattern are sent to the group once instead of down
+// every member's TCP stream. A message goes to the first group matching it.
+// Each group numbers its messages and keeps the last MCAST_HISTORY frames,
+// a member that sees a gap asks for them with HB_REPAIR and gets them on
+// its TCP stream
+typedef struct {
+    char *pattern;
+    struct sockaddr_in addr;
+    _Atomic uint64_t seq;       // last sent, written by the routing loop
+    pthread_mutex_t lock;       // history, routing loop and repairs
+    out_msg_t *history[MCAST_HISTORY]; // frame of seq at seq % MCAST_HISTORY
+} mcast_group_t;
+
+// frames resent to one subscriber, picked up by its sender
+typedef struct repair {
+    struct repair *next;
+    uint32_t len;
+    char data[];
+} repair_t;
+
+static mcast_group_t mcast_groups[MCAST_GROUPS];
+static int mcast_count;
+static int mcast_fd = -1;
+static uint32_t mcast_source;
+static struct in_addr mcast_iface; // -i, INADDR_ANY lets the routing table pick
+static _Atomic uint64_t mcast_errors;
+
+// add a group from "pattern@address:port"
+static int mcast_add(const char *spec) {
+    const char *at = strrchr(spec, '@');
+    const char *colon = at ? strrchr(at, ':') : NULL;
+    if (!at || !colon || at == spec || at - spec > MAX_TOPIC_LEN || mcast_count == MCAST_GROUPS) {
+        return -1;
+    }
+    char host[INET_ADDRSTRLEN];
+    size_t host_len = colon - at - 1;
+    if (host_len >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, at + 1, host_len);
+    host[host_len] = '\0';
+    mcast_group_t *g = &mcast_groups[mcast_count];
+    g->addr.sin_family = AF_INET;
+    g->addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &g->addr.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(g->addr.sin_addr.s_addr)) || !g->addr.sin_port ||
+        !(g->pattern = strndup(spec, at - spec))) {
+        return -1;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    mcast_count++;
+    return 0;
+}
+
+static int mcast_init(void) {
+    mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mcast_fd < 0) {
+        perror("[PUB] multicast socket");
+        return -1;
+    }
+    unsigned char loop = 1, ttl = 1;
+    setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (mcast_iface.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &mcast_iface, sizeof(mcast_iface)) < 0) {
+        perror("[PUB] multicast interface");
+        return -1;
+    }
+    mcast_source = ((uint32_t)time(NULL) * 2246822519u) ^ ((uint32_t)getpid() << 8) ^ 0x5bd1e995;
+    for (int g = 0; g < mcast_count; g++) {
+        printf("[PUB] Multicasting %s on %s:%u\n", mcast_groups[g].pattern,
+               inet_ntoa(mcast_groups[g].addr.sin_addr), ntohs(mcast_groups[g].addr.sin_port));
+    }
+    return 0;
+}
+
+// the group a published topic goes to, -1 for none
+static int mcast_group_of(const char *topic) {
+    for (int g = 0; g < mcast_count; g++) {
+        if (topic_matches(topic, mcast_groups[g].pattern)) {
+            return g;
+        }
+    }
+    return -1;
+}
+
+// groups whose pattern the subscriber has
+static uint32_t mcast_membership(const subscriber_t *sub) {
+    uint32_t groups = 0;
+    for (int g = 0; g < mcast_count; g++) {
+        for (int t = 0; t < sub->topic_count; t++) {
+            if (strcmp(sub->topics[t], mcast_groups[g].pattern) == 0) {
+                groups |= 1u << g;
+                break;
+            }
+        }
+    }
+    return groups;
+}
+
+// routing loop. number, keep and send one message to group g.
+// returns 0 if the send failed, members get it with a repair
+static int mcast_send(int g, const char *topic, uint16_t topic_len,
+                      const char *payload, uint32_t len, uint64_t gen) {
+    mcast_group_t *grp = &mcast_groups[g];
+    out_msg_t *m = frame_create(topic, topic_len, payload, len, 1, NULL);
+    if (!m) {
+        atomic_fetch_add(&pub_error, 1);
+        return 0;
+    }
+    uint64_t seq = atomic_load_explicit(&grp->seq, memory_order_relaxed) + 1;
+    pthread_mutex_lock(&grp->lock);
+    out_msg_t **slot = &grp->history[seq & (MCAST_HISTORY - 1)];
+    if (*slot) {
+        msg_release(*slot);
+    }
+    *slot = m;
+    atomic_store(&grp->seq, seq);
+    pthread_mutex_unlock(&grp->lock);
+
+    mcast_hdr_t hdr = {
+        .source = htonl(mcast_source),
+        .group = htons(g),
+        .seq = htobe64(seq),
+        .lvc_gen = htobe64(gen),
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = m->data, .iov_len = m->len },
+    };
+    struct msghdr mh = {
+        .msg_name = &grp->addr,
+        .msg_namelen = sizeof(grp->addr),
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+    if (sendmsg(mcast_fd, &mh, 0) < 0) {
+        atomic_fetch_add(&mcast_errors, 1);
+        return 0;
+    }
+    return 1;
+}
+
+// add the frame moving the subscriber's pattern to group g to the end of
+// its snapshot. called in the table write section that activates it
+static int mcast_offer(sub_queue_t *q, int g, uint64_t gen) {
+    mcast_group_t *grp = &mcast_groups[g];
+    uint16_t pattern_len = strlen(grp->pattern);
+    uint32_t total = sizeof(frame_hdr_t) + pattern_len + sizeof(mcast_offer_t);
+    char *grown = realloc(q->snapshot, q->snapshot_len + total);
+    if (!grown) {
+        return -1;
+    }
+    frame_hdr_t hdr = {
+        .len = htonl(sizeof(mcast_offer_t)),
+        .topic_len = htons(pattern_len),
+        .flags = htons(FRAME_MCAST),
+    };
+    mcast_offer_t offer = {
+        .source = htonl(mcast_source),
+        .group = htons(g),
+        .port = grp->addr.sin_port,
+        .addr = grp->addr.sin_addr.s_addr,
+        .iface = mcast_iface.s_addr,
+        .next_seq = htobe64(atomic_load(&grp->seq) + 1),
+        .lvc_gen = htobe64(gen),
+    };
+    char *at = grown + q->snapshot_len;
+    memcpy(at, &hdr, sizeof(hdr));
+    memcpy(at + sizeof(hdr), grp->pattern, pattern_len);
+    memcpy(at + sizeof(hdr) + pattern_len, &offer, sizeof(offer));
+    q->snapshot = grown;
+    q->snapshot_len += total;
+    return 0;
+}
+
+// heartbeat thread. hand the subscriber's sender a FRAME_REPAIR and the
+// frames of seq from..to on group g that the history still has, even when
+// that is none of them, so it stops asking. returns 0 if out of memory
+static int mcast_repair(sub_queue_t *q, int g, uint64_t from, uint64_t to) {
+    mcast_group_t *grp = &mcast_groups[g];
+    mcast_repaired_t reply = {
+        .source = htonl(mcast_source),
+        .group = htons(g),
+        .asked = htobe64(from),
+    };
+    pthread_mutex_lock(&grp->lock);
+    uint64_t last = atomic_load(&grp->seq);
+    if (to > last) {
+        to = last;
+    }
+    if (last >= MCAST_HISTORY && from <= last - MCAST_HISTORY) {
+        from = last - MCAST_HISTORY + 1; //older ones are gone
+    }
+    if (!from) {
+        from = 1;
+    }
+    if (from <= to && to - from >= MCAST_REPAIR_MAX) {
+        to = from + MCAST_REPAIR_MAX - 1; //it asks again for the rest
+    }
+    reply.kept = htobe64(from);
+    reply.to = htobe64(to);
+    uint16_t pattern_len = strlen(grp->pattern);
+    frame_hdr_t hdr = {
+        .len = htonl(sizeof(reply)),
+        .topic_len = htons(pattern_len),
+        .flags = htons(FRAME_REPAIR),
+    };
+    size_t bytes = sizeof(hdr) + pattern_len + sizeof(reply);
+    for (uint64_t seq = from; seq <= to; seq++) {
+        bytes += grp->history[seq & (MCAST_HISTORY - 1)]->len;
+    }
+    repair_t *r = malloc(sizeof(*r) + bytes);
+    if (r) {
+        memcpy(r->data, &hdr, sizeof(hdr));
+        memcpy(r->data + sizeof(hdr), grp->pattern, pattern_len);
+        memcpy(r->data + sizeof(hdr) + pattern_len, &reply, sizeof(reply));
+        r->len = sizeof(hdr) + pattern_len + sizeof(reply);
+        for (uint64_t seq = from; seq <= to; seq++) {
+            out_msg_t *m = grp->history[seq & (MCAST_HISTORY - 1)];
+            memcpy(r->data + r->len, m->data, m->len);
+            r->len += m->len;
+        }
+    }
+    pthread_mutex_unlock(&grp->lock);
+    if (!r) {
+        return 0;
+    }
+    repair_t *head = atomic_load_explicit(&q->repairs, memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&q->repairs, &head, r));
+    return 1;
+}
+
+// sender side. make the waiting repairs the snapshot, oldest first
+static void repair_take(sub_queue_t *q) {
+    repair_t *list = atomic_exchange(&q->repairs, NULL);
+    repair_t *prev = NULL;
+    size_t bytes = 0;
+    while (list) { //reverse, it was pushed newest first
+        repair_t *next = list->next;
+        list->next = prev;
+        prev = list;
+        bytes += list->len;
+        list = next;
+    }
+    char *buf = bytes ? malloc(bytes) : NULL;
+    q->snapshot_len = 0;
+    q->snapshot_sent = 0;
+    for (repair_t *r = prev; r; ) {
+        repair_t *next = r->next;
+        if (buf) {
+            memcpy(buf + q->snapshot_len, r->data, r->len);
+            q->snapshot_len += r->len;
+        }
+        free(r);
+        r = next;
+    }
+    q->snapshot = buf;
+}
+
+// router side. returns 0 when the queue is full
+static int queue_push(sub_queue_t *q, out_msg_t *m) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail == SUB_QUEUE_DEPTH) {
+        return 0;
+    }
+    q->msgs[head & (SUB_QUEUE_DEPTH - 1)] = m;
+    atomic_store_explicit(&q->pushed_bytes,
+                          atomic_load_explicit(&q->pushed_bytes, memory_order_relaxed) + m->len,
+                          memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+static int queue_full(sub_queue_t *q) {
+    return atomic_load_explicit(&q->head, memory_order_relaxed) -
+           atomic_load_explicit(&q->tail, memory_order_acquire) == SUB_QUEUE_DEPTH;
+}
+
+// bytes waiting in the queue, either side
+static uint64_t queue_bytes(sub_queue_t *q) {
+    uint64_t popped = atomic_load_explicit(&q->popped_bytes, memory_order_relaxed);
+    uint64_t pushed = atomic_load_explicit(&q->pushed_bytes, memory_order_relaxed);
+    return pushed - popped;
+}
+
+static void queue_popped_bytes(sub_queue_t *q, uint64_t bytes) {
+    atomic_store_explicit(&q->popped_bytes,
+                          atomic_load_explicit(&q->popped_bytes, memory_order_relaxed) + bytes,
+                          memory_order_relaxed);
+}
+
+// sender side
+static out_msg_t *queue_peek(sub_queue_t *q) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) {
+        return NULL;
+    }
+    return q->msgs[tail & (SUB_QUEUE_DEPTH - 1)];
+}
+
+static void queue_pop(sub_queue_t *q) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    queue_popped_bytes(q, q->msgs[tail & (SUB_QUEUE_DEPTH - 1)]->len);
+    q->sent = 0;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
 
-#define MAX_SUBS 128
-#define MAX_TOPIC_LEN 64
-#define TOPIC_CAPACITY 16
-#define MAX_BUFFER_SIZE 1024
-#define DEFAULT_PORT 5555
-#define MICROSERVICE_PORT 4444
-#define HEARTBEAT_PORT 5554
-#define SUBSCRIBER_TIMEOUT 10 
+// sender side. drop the oldest unsent frames until at least bytes are gone.
+// a frame that is partly on the wire is kept and moves up over the dropped
+// ones, so the stream stays framed. returns the number of frames dropped
+static int queue_drop_oldest(sub_queue_t *q, uint64_t bytes) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    out_msg_t *partial = q->sent ? q->msgs[tail & (SUB_QUEUE_DEPTH - 1)] : NULL;
+    uint32_t i = tail + (partial != NULL);
+    uint64_t freed = 0;
+    int dropped = 0;
+
+    while (i != head && freed < bytes) {
+        out_msg_t *m = q->msgs[i & (SUB_QUEUE_DEPTH - 1)];
+        freed += m->len;
+        msg_release(m);
+        i++;
+        dropped++;
+    }
+    if (!dropped) {
+        return 0;
+    }
+    if (partial) {
+        i--;
+        q->msgs[i & (SUB_QUEUE_DEPTH - 1)] = partial;
+    }
+    queue_popped_bytes(q, freed);
+    atomic_store_explicit(&q->tail, i, memory_order_release);
+    return dropped;
+}
 
-typedef struct __attribute__((packed)) {
-    uint32_t system_id;
-    uint16_t advertised_port;
-    uint16_t topic_count; 
-    char topics[TOPIC_CAPACITY][MAX_TOPIC_LEN];
-    uint64_t timestamp; // Time when the heartbeat was sent
-} heartbeat_t;
+// sender side. done with a log replay, or dropping it
+static void replay_finish(sub_queue_t *q) {
+    if (q->replay_topics) {
+        log_reader_done();
+    }
+    for (int t = 0; t < q->replay_topic_count; t++) {
+        free(q->replay_topics[t]);
+    }
+    free(q->replay_topics);
+    q->replay_topics = NULL;
+    q->replay_topic_count = 0;
+    q->replay_pos = q->replay_end = q->replay_run = 0;
+    atomic_store(&q->replaying, 0);
+}
 
-typedef struct {
-    int tcp_sock;  // TCP socket file descriptor
-    uint32_t ip_addr;
-    uint16_t port;
-    uint32_t subscriber_id; 
-    char topics[TOPIC_CAPACITY][MAX_TOPIC_LEN];
-    int topic_count;
-    int topic_received;
-    time_t last_heartbeat; //healthcheck
-} subscriber_t;
+// sender side, the replay got to replay_end. It follows the log while the
+// log grows, the router meanwhile drops its live frames. Once the router is
+// told to queue again, one more look at the log end: whatever the router
+// dropped is before it, anything later reaches the subscriber live.
+// returns 1 when the replay is done
+static int replay_extend(sub_queue_t *q) {
+    if (!atomic_load(&q->replaying)) {
+        return 1;
+    }
+    uint64_t end = atomic_load(&log_end);
+    if (end == q->replay_end) {
+        atomic_store(&q->replaying, 0);
+        end = atomic_load(&log_end);
+    }
+    if (end == q->replay_end) {
+        return 1;
+    }
+    q->replay_end = end;
+    return 0;
+}
 
-typedef struct {
-    int socket; //publisher socket
-    subscriber_t *subs;
-} subs_t;
+// sender side. point iov at the rest of the matching run being replayed,
+// looking for the next run once it is out. returns the iov count
+static int replay_gather(sub_queue_t *q, struct iovec *iov) {
+    while (q->replay_pos == q->replay_run) {
+        if (q->replay_pos >= q->replay_end && replay_extend(q)) {
+            replay_finish(q);
+            return 0;
+        }
+        // records in between are for other topics and never sent
+        q->replay_run = log_match(q->replay_pos, q->replay_end, q->replay_topics,
+                                  q->replay_topic_count, &q->replay_pos, &q->replay_at);
+    }
+    iov->iov_base = (char *)q->replay_at;
+    iov->iov_len = q->replay_run - q->replay_pos;
+    return 1;
+}
 
-static subscriber_t subs[MAX_SUBS];
-pthread_mutex_t subs_lock; //threadsafety for subs list
-static _Atomic uint64_t pub_success   = 0; 
-static _Atomic uint64_t pub_error  = 0; 
+// sender side. done with the last-value snapshot, or dropping it
+static void snapshot_finish(sub_queue_t *q) {
+    free(q->snapshot);
+    q->snapshot = NULL;
+    q->snapshot_len = q->snapshot_sent = 0;
+}
 
+// sender side. point iov at what is left of a log replay, or at the rest of
+// the snapshot and up to max queued frames, the first one from where the
+// last write stopped. returns the iov count
+static int queue_gather(sub_queue_t *q, struct iovec *iov, int max) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    int n = 0;
+    if (q->replay_topics && (n = replay_gather(q, iov))) {
+        return n; //the rest waits for the replay
+    }
+    if (!q->snapshot && atomic_load_explicit(&q->repairs, memory_order_acquire)) {
+        repair_take(q);
+    }
+    if (q->snapshot) {
+        iov[n].iov_base = q->snapshot + q->snapshot_sent;
+        iov[n].iov_len = q->snapshot_len - q->snapshot_sent;
+        n++;
+    }
+    for (uint32_t i = tail; i != head && n < max; i++, n++) {
+        out_msg_t *m = q->msgs[i & (SUB_QUEUE_DEPTH - 1)];
+        size_t skip = (i == tail) ? q->sent : 0;
+        iov[n].iov_base = m->data + skip;
+        iov[n].iov_len = m->len - skip;
+    }
+    return n;
+}
 
-char* microservice_message;
-int microservice_fd = -1;
-int pipe_fds[2];    //used to write data from microservice thread to sending thread
+// sender side. account for written bytes, replay or snapshot first,
+// popping every frame that went out
+static void queue_consume(sub_queue_t *q, size_t written) {
+    out_msg_t *m;
+    if (q->replay_topics) {
+        uint64_t left = q->replay_run - q->replay_pos;
+        uint64_t took = written < left ? written : left;
+        q->replay_pos += took;
+        q->replay_at += took;
+        written -= took;
+        if (q->replay_pos == q->replay_end && replay_extend(q)) {
+            replay_finish(q); //caught up, the live frames follow
+        }
+    } else if (q->snapshot) {
+        uint32_t left = q->snapshot_len - q->snapshot_sent;
+        uint32_t took = written < left ? written : left;
+        q->snapshot_sent += took;
+        written -= took;
+        if (q->snapshot_sent == q->snapshot_len) {
+            snapshot_finish(q);
+        }
+    }
+    while (written && (m = queue_peek(q))) {
+        size_t left = m->len - q->sent;
+        if (written < left) {
+            q->sent += written;
+            return;
+        }
+        written -= left;
+        atomic_fetch_add(&pub_success, 1);
+        queue_pop(q);
+        msg_release(m);
+    }
+}
 
-int connect_to_subscriber(uint32_t ip_addr, uint16_t port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return -1;
+// sender side, a snapshot, a replay, repairs or frames still to send
+static int queue_pending(sub_queue_t *q) {
+    return q->snapshot || q->replay_topics || atomic_load(&q->repairs) || queue_peek(q);
+}
+
+// Ingest hand-off
+static void ingest_ring_init(ingest_ring_t *r) {
+    for (uint32_t i = 0; i < INGEST_BUFFERS; i++) {
+        atomic_init(&r->cells[i].seq, i);
+        r->cells[i].buf = NULL;
     }
+    atomic_init(&r->enqueue_pos, 0);
+    atomic_init(&r->dequeue_pos, 0);
+}
 
-    struct sockaddr_in sub_addr;
-    memset(&sub_addr, 0, sizeof(sub_addr));
-    sub_addr.sin_family = AF_INET;
-    sub_addr.sin_port = htons(port);
-    sub_addr.sin_addr.s_addr = ip_addr;
+static int ingest_ring_push(ingest_ring_t *r, ingest_buf_t *buf) {
+    uint32_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    ingest_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & (INGEST_BUFFERS - 1)];
+        uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; //full
+        } else {
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->buf = buf;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
 
-    if (connect(sock, (struct sockaddr *)&sub_addr, sizeof(sub_addr)) < 0) {
-        perror("connect to subscriber");
-        close(sock);
-        return -1;
+static ingest_buf_t *ingest_ring_pop(ingest_ring_t *r) {
+    uint32_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    ingest_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & (INGEST_BUFFERS - 1)];
+        uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL; //empty
+        } else {
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+        }
     }
+    ingest_buf_t *buf = cell->buf;
+    atomic_store_explicit(&cell->seq, pos + INGEST_BUFFERS, memory_order_release);
+    return buf;
+}
 
-    return sock;
+// routing loop side. only sleeps (one eventfd read) when the ring is empty
+static ingest_buf_t *ingest_wait(void) {
+    ingest_buf_t *buf;
+    while (!(buf = ingest_ring_pop(&ingest_ready))) {
+        atomic_store(&router_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((buf = ingest_ring_pop(&ingest_ready))) {
+            atomic_store(&router_sleeping, 0);
+            break;
+        }
+        uint64_t count;
+        if (read(ingest_event_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            perror("ingest eventfd");
+        }
+        atomic_store(&router_sleeping, 0);
+    }
+    return buf;
 }
-// match sub-topics separated by colon
-static int topic_matches(const char *published, const char *sub) {
-    size_t len = strlen(sub);
-    if (strcmp(published, sub) == 0) {
-        return 1;
+
+// microservice side. only makes a syscall when the routing loop is asleep
+static void ingest_wake(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&router_sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(ingest_event_fd, &one, sizeof(one)) < 0) {
+            perror("ingest wake");
+        }
     }
+}
 
-    if (strncmp(published, sub, len) == 0 && published[len] == ':') {
-        return 1;
+static void sender_wake(sender_t *w) {
+    if (atomic_exchange(&w->sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(w->event_fd, &one, sizeof(one)) < 0) {
+            perror("sender wake");
+        }
     }
-    return 0;
+}
+
+// Put a slot on its sender's ready list, so senders only look at subscribers
+// that have work instead of walking the table. Any thread may call it.
+// Returns the sender to wake, -1 if the slot was already listed
+static int sender_schedule(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    if (atomic_exchange(&sub->scheduled, 1)) {
+        return -1;
+    }
+    sender_t *w = &senders[slot % sender_count];
+    int head = atomic_load_explicit(&w->ready, memory_order_relaxed);
+    do {
+        sub->ready_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&w->ready, &head, slot,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return w->id;
+}
+
+// Take a sender's whole ready list. Walk it with sender_next
+static int sender_take(sender_t *w) {
+    return atomic_exchange_explicit(&w->ready, -1, memory_order_acquire);
+}
+
+static int sender_next(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    int next = sub->ready_next;
+    atomic_store(&sub->scheduled, 0);
+    return next;
 }
 
 //Debug only
-void debug_subscription_matching(subscriber_t *subs, const char *topic, const char *msg) {
+void debug_subscription_matching(const char *topic, const char *msg) {
     printf("=== Debug: publishing message on topic '%s': \"%s\" ===\n",topic, msg);
 
-    for (int i = 0; i < MAX_SUBS; i++) {
-        subscriber_t *sub = &subs[i];
+    int slots = atomic_load(&sub_slots);
+    for (int i = 0; i < slots; i++) {
+        subscriber_t *sub = sub_at(i);
         if (sub->tcp_sock < 0) continue;  // skip unused slots
 
         // Convert IP to dotted-quad
@@ -137,104 +2159,721 @@ void debug_subscription_matching(subscriber_t *subs, const char *topic, const ch
 }
 
 
-void handle_messaging(subscriber_t *subs) {
-    char input[MAX_BUFFER_SIZE] = {0};
-    // if (!fgets(input, sizeof(input), stdin)) {
-        // return;
-    // }
-    // data received from microservice input
-    // printf("pipe_fds: %d %d\n", pipe_fds[0], pipe_fds[1]);
-    if(pipe_fds[0] == STDIN_FILENO){
-        // try again to ensure that only messages from microservice are received
-       return;
+// Queue a frame for one subscriber under its backpressure policy. Router side.
+// Returns 1 if it was queued
+static int subscriber_enqueue(int slot, out_msg_t *m, uint64_t *woken) {
+    subscriber_t *sub = sub_at(slot);
+    sub_queue_t *q = &sub->queue;
+
+    while (queue_full(q) || queue_bytes(q) + m->len > sub->lag_limit) {
+        if (atomic_load(&q->replaying)) {
+            return 0; //logged, its replay sends it
+        }
+        // the reactor can't wait on itself, it treats block as drop-newest
+        if (sub->policy == BP_BLOCK && !reactor_mode &&
+            atomic_load(&sub->state) == SUB_ACTIVE) {
+            sender_schedule(slot);
+            sender_wake(&senders[slot % sender_count]);
+            sched_yield();
+            continue;
+        }
+        if (sub->policy == BP_DROP_OLDEST && !queue_full(q)) {
+            break; //its sender trims the oldest frames
+        }
+        // drop this one. a BP_DISCONNECT sender evicts it once it sees the lag
+        atomic_fetch_add(&sub->dropped, 1);
+        atomic_fetch_add(&pub_error, 1);
+        if (sub->policy == BP_DISCONNECT && sender_schedule(slot) >= 0) {
+            *woken |= 1ULL << (slot % sender_count);
+        }
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    queue_push(q, m);
+    if (sender_schedule(slot) >= 0) {
+        *woken |= 1ULL << (slot % sender_count);
     }
-    if(read(pipe_fds[0],input,sizeof(input)) < 0){
-        fprintf(stderr, "Could not read from ms fd: %s\n",strerror(errno));
-       return;
+    return 1;
+}
+
+// Queue one "<topic> <message>" line (no newline) for every matching
+// subscriber and put them on their senders' ready lists. Senders that need
+// waking are ORed into woken. Returns the number of subscriber queues it went to.
+int route_message(char *line, size_t len, uint64_t *woken) {
+    while (len && *line == ' ') {
+        line++;
+        len--;
     }
-    char *topic = strtok(input, " \n");
-    char *msg = strtok(NULL, "\n");
+    char *space = memchr(line, ' ', len);
 
     // printf("topic: %s. message: %s\n", topic, msg);
     //special stat case
-    if (!topic || !msg) {
+    if (!space || space + 1 == line + len) {
         // printf("Usage: <topic> <message>\n");
-        return;
+        return 0;
     }
+    *space = '\0';
+    char *topic = line;
+    size_t topic_len = space - line;
+    char *msg = space + 1;
+    int msg_len = len - topic_len - 1;
+
     if(strcmp(topic,"stat") == 0){
         uint64_t pubs = atomic_load(&pub_success);
         uint64_t errors = atomic_load(&pub_error);
         printf("[PUB][STAT] success=%lu, failure=%lu\n",
                    (unsigned long)pubs,
                    (unsigned long)errors);
-        return;
+        if (log_dir) {
+            printf("[PUB][STAT] log %08x seq=%lu bytes=%lu skipped=%lu\n", log_id,
+                   (unsigned long)log_seq,
+                   (unsigned long)atomic_load(&log_end),
+                   (unsigned long)atomic_load(&log_skipped));
+        }
+        printf("[PUB][STAT] last values for %d topics\n", lvc_count);
+        if (batch_delay_ns) {
+            printf("[PUB][STAT] batches delay=%luus bytes=%u full=%lu expired=%lu\n",
+                   (unsigned long)(batch_delay_ns / 1000), batch_bytes,
+                   (unsigned long)atomic_load(&batch_full),
+                   (unsigned long)atomic_load(&batch_expired));
+        }
+        if (shm_ring) {
+            printf("[PUB][STAT] shm readers=%d head=%lu dropped=%lu\n",
+                   __builtin_popcountll(atomic_load(&shm_active)),
+                   (unsigned long)atomic_load(&shm_ring->head),
+                   (unsigned long)atomic_load(&shm_dropped));
+        }
+        for (int g = 0; g < mcast_count; g++) {
+            printf("[PUB][STAT] multicast %s seq=%lu send_errors=%lu\n", mcast_groups[g].pattern,
+                   (unsigned long)atomic_load(&mcast_groups[g].seq),
+                   (unsigned long)atomic_load(&mcast_errors));
+        }
+        // only the subscribers that have fallen behind at some point
+        int slots = atomic_load(&sub_slots);
+        for (int i = 0; i < slots; i++) {
+            subscriber_t *sub = sub_at(i);
+            uint64_t dropped = atomic_load(&sub->dropped);
+            uint64_t max_lag = atomic_load(&sub->max_lag);
+            if (atomic_load(&sub->state) != SUB_ACTIVE || (!dropped && !max_lag)) {
+                continue;
+            }
+            struct in_addr in = { .s_addr = sub->ip_addr };
+            printf("[PUB][STAT] %s:%u policy=%s dropped=%lu lag=%lu max_lag=%lu\n",
+                   inet_ntoa(in), sub->port, bp_names[sub->policy],
+                   (unsigned long)dropped,
+                   (unsigned long)atomic_load(&sub->lag_bytes),
+                   (unsigned long)max_lag);
+        }
+        return 0;
     }
-    if( strlen(topic) > MAX_TOPIC_LEN){
+    if( topic_len > MAX_TOPIC_LEN){
         printf("Invalid topic\n");
+        return 0;
+    }
+
+    // look up matching subs in the topic index, lock free. a snapshot is
+    // only used if no writer changed the table while it was taken
+    int count = 0;
+    int touched;
+    out_msg_t *out = NULL;
+    uint32_t seq;
+    frame_seq_t fseq, *logged = NULL;
+    uint64_t shm_readers = 0;
+    int group = mcast_count ? mcast_group_of(topic) : -1;
+    int group_members = 0;
+    // logged and cached before the subscribers are looked up: one that is not
+    // in the snapshot yet gets the message from its replay or last values
+    if (log_dir) {
+        fseq = (frame_seq_t){
+            .seq = ++log_seq,
+            .log_id = log_id,
+            .topic_seq = log_topic_seq(topic, topic_len),
+        };
+        logged = &fseq;
+        out = frame_create(topic, topic_len, msg, msg_len, 1, logged);
+        if (!out) {
+            atomic_fetch_add(&log_skipped, 1);
+        } else {
+            log_append(out, fseq.seq);
+        }
+    }
+    uint64_t gen = lvc_store(topic, topic_len, msg, msg_len, logged);
+    while (1) {
+        seq = table_read_begin();
+        touched = topic_index_route(topic);
+        for (int t = 0; t < touched; t++) {
+            int w = route_touched[t];
+            uint64_t bits = route_targets[w];
+            while (bits) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (atomic_load(&sub_at(i)->state) != SUB_ACTIVE) {
+                    route_targets[w] &= ~(1ULL << (i % 64));
+                }
+            }
+        }
+        if (!table_read_retry(seq)) {
+            break;
+        }
+        topic_index_route_done(touched);
+    }
+
+    for (int t = 0; t < touched; t++) {
+        int w = route_touched[t];
+        uint64_t bits = route_targets[w];
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            // debug_subscription_matching(topic, msg); //print out a bunch of stuff
+
+            // stored before it connected, routed after: its snapshot has it
+            if (gen && gen <= sub_at(i)->lvc_gen) {
+                continue;
+            }
+            // same-host readers get it from the ring, one copy for all of them
+            int shm_slot = sub_at(i)->shm_slot;
+            if (shm_slot >= 0) {
+                shm_readers |= 1ULL << shm_slot;
+                continue;
+            }
+            // so do the members of its multicast group
+            if (group >= 0 && (sub_at(i)->mcast_groups & (1u << group))) {
+                group_members = 1;
+                continue;
+            }
+
+            // one shared copy, extra reference held until queuing is done
+            if (!out && !(out = frame_create(topic, topic_len, msg, msg_len, 1, NULL))) {
+                atomic_fetch_add(&pub_error, 1);
+                continue;
+            }
+            count += subscriber_enqueue(i, out, woken);
+        }
+    }
+    topic_index_route_done(touched);
+
+    if (shm_readers) {
+        count += shm_append(topic, topic_len, msg, msg_len, logged, shm_readers);
+    }
+    if (group_members) {
+        count += mcast_send(group, topic, topic_len, msg, msg_len, gen);
+    }
+    if (out) {
+        msg_release(out);
+    }
+    return count;
+}
+
+// Streaming ingest parser
+// the microservice feed is "<topic> <message>\n" lines sent back to back, so
+// one recv holds many lines and can end in the middle of one. the buffer is
+// scanned for '\n' 32 (AVX2) or 16 (SSE2) bytes at a time and every complete
+// line is routed in place. a trailing partial line waits in carry for the
+// next recv
+#define INGEST_MAX_LINE (MAX_BUFFER_SIZE * 2)
+
+typedef struct {
+    char carry[INGEST_MAX_LINE];
+    size_t carry_len;
+    int overflow;   // skipping an over-long line up to its newline
+} ingest_parser_t;
+
+// bitmask of the '\n' bytes in the next block, sets how many bytes it covers
+static inline uint32_t newline_mask(const char *p, const char *end, int *width) {
+#if defined(__AVX2__)
+    if (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        *width = 32;
+        return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    }
+#endif
+#if defined(__SSE2__)
+    if (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        *width = 16;
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    }
+#endif
+    *width = 1;
+    return *p == '\n';
+}
+
+static int ingest_line(ingest_parser_t *p, char *line, size_t len, uint64_t *woken) {
+    if (p->overflow) {
+        p->overflow = 0; // end of the line we were skipping
+        return 0;
+    }
+    if (p->carry_len) {
+        // finish the line the last recv cut off
+        if (p->carry_len + len > INGEST_MAX_LINE) {
+            p->carry_len = 0;
+            atomic_fetch_add(&pub_error, 1);
+            return 0;
+        }
+        memcpy(p->carry + p->carry_len, line, len);
+        line = p->carry;
+        len += p->carry_len;
+        p->carry_len = 0;
+    }
+    return route_message(line, len, woken);
+}
+
+// Route every complete line in buf. Returns the number of queued messages
+int ingest_parse(ingest_parser_t *p, char *buf, size_t len, uint64_t *woken) {
+    char *end = buf + len;
+    char *start = buf;
+    int count = 0;
+
+    for (char *cur = buf; cur < end; ) {
+        int width;
+        uint32_t mask = newline_mask(cur, end, &width);
+        while (mask) {
+            char *nl = cur + __builtin_ctz(mask);
+            mask &= mask - 1;
+            count += ingest_line(p, start, nl - start, woken);
+            start = nl + 1;
+        }
+        cur += width;
+    }
+
+    size_t rest = end - start;
+    if (rest && !p->overflow) {
+        if (p->carry_len + rest > INGEST_MAX_LINE) {
+            p->carry_len = 0;
+            p->overflow = 1;
+            atomic_fetch_add(&pub_error, 1);
+        } else {
+            memcpy(p->carry + p->carry_len, start, rest);
+            p->carry_len += rest;
+        }
+    }
+    return count;
+}
+
+void handle_messaging(void) {
+    static ingest_parser_t parser;
+
+    // data received from microservice input, routed straight out of its buffer
+    ingest_buf_t *buf = ingest_wait();
+
+    uint64_t woken = 0;
+    int count = ingest_parse(&parser, buf->data, buf->len, &woken);
+    ingest_ring_push(&ingest_free, buf);
+    // quiescent point, senders may now reclaim slots that were CLOSING
+    atomic_fetch_add(&router_epoch, 1);
+    if (!count) {
         return;
     }
-    int msg_len = strlen(msg);
+    // wake the senders that got new work
+    for (int w = 0; w < SENDER_THREADS; w++) {
+        if (woken & (1ULL << w)) {
+            sender_wake(&senders[w]);
+        }
+    }
+}
 
-    // check all subs/topics
-    for (int i = 0; i < MAX_SUBS; i++) {
-        pthread_mutex_lock(&subs_lock);
-        if (subs[i].tcp_sock >= 0 && subs[i].topic_received) {
-            for (int t = 0; t < subs[i].topic_count; t++) {
-                if (topic_matches(topic, subs[i].topics[t])) {
-                    // strcat(msg, "\0");
-                    // debug_subscription_matching(subs, topic, msg); //print out a bunch of stuff
-
-                    int result = send(subs[i].tcp_sock, msg, msg_len, 0);
-                    if (result == msg_len) {
-                        atomic_fetch_add(&pub_success, 1);
-                    } else {
-                        atomic_fetch_add(&pub_error, 1);
-                    }
-                    // send(subs[i].tcp_sock, "\0", strlen("\0"), 0);
-                    break;  // no need to check other subscripts
+// Drop everything still queued for a slot, its snapshot, repairs and replay.
+// Sender side only.
+static void drain_subscriber(subscriber_t *sub) {
+    out_msg_t *m;
+    if (atomic_load(&sub->queue.repairs)) {
+        repair_take(&sub->queue);
+    }
+    if (sub->queue.snapshot) {
+        snapshot_finish(&sub->queue);
+    }
+    if (sub->queue.replay_topics) {
+        replay_finish(&sub->queue);
+    }
+    while ((m = queue_peek(&sub->queue))) {
+        queue_pop(&sub->queue);
+        msg_release(m);
+        atomic_fetch_add(&pub_error, 1);
+    }
+}
+
+// Nagle with a deadline, sender side. Frames wait until batch_bytes of them
+// are queued or the first has waited batch_delay_ns. A catch-up, repairs or
+// a frame the socket took half of go right away.
+// Returns the deadline while they wait, 0 when they go now
+static uint64_t batch_hold(subscriber_t *sub) {
+    sub_queue_t *q = &sub->queue;
+    if (!batch_delay_ns || !queue_pending(q)) {
+        return 0;
+    }
+    if (q->snapshot || q->replay_topics || atomic_load(&q->repairs) || q->sent) {
+        sub->batch_due = 0;
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+    if (!sub->batch_due) {
+        sub->batch_due = now + batch_delay_ns;
+    }
+    if (queue_bytes(q) >= batch_bytes) {
+        atomic_fetch_add_explicit(&batch_full, 1, memory_order_relaxed);
+    } else if (now >= sub->batch_due) {
+        atomic_fetch_add_explicit(&batch_expired, 1, memory_order_relaxed);
+    } else {
+        return sub->batch_due;
+    }
+    sub->batch_due = 0;
+    return 0;
+}
+
+// Write as much of a subscriber's queue as the socket takes.
+// Returns 1 if the socket is full and messages are still waiting,
+// -1 if the connection is broken. Every pending frame goes out in one sendmsg (FLUSH_IOV at a time).
+static int flush_subscriber(subscriber_t *sub) {
+    sub_queue_t *q = &sub->queue;
+    struct iovec iov[FLUSH_IOV];
+    struct msghdr msg = { .msg_iov = iov };
+    int count;
+    while ((count = queue_gather(q, iov, FLUSH_IOV)) > 0) {
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(sub->tcp_sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            atomic_fetch_add(&pub_error, 1);
+            return -1; //broken connection
+        }
+        queue_consume(q, n);
+    }
+    return 0;
+}
+
+// Hand a CLOSING slot back to the heartbeat listener.
+static void release_subscriber(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    drain_subscriber(sub);
+    if (sub->tcp_sock >= 0) {
+        close(sub->tcp_sock); //the reactor may have taken it to close later
+    }
+
+    pthread_mutex_lock(&subs_lock);
+    for (int t = 0; t < sub->topic_count; t++) {
+        free(sub->topics[t]);
+    }
+    free(sub->topics);
+    for (int t = 0; t < sub->entry_count; t++) {
+        free(sub->entries[t]);
+    }
+    free(sub->entries);
+    sub->topics          = NULL;
+    sub->entries         = NULL;
+    sub->entry_count     = 0;
+    sub->epoch           = 0;
+    sub->tcp_sock        = -1;
+    sub->ip_addr         = 0;
+    sub->port            = 0;
+    sub->subscriber_id   = 0;
+    sub->topic_count     = 0;
+    sub->topic_received  = 0;
+    sub->last_heartbeat  = 0;
+    sub->blocked         = 0;
+    sub->watched         = 0; //close() took it out of the epoll set
+    sub->dropped         = 0;
+    sub->lag_bytes       = 0;
+    sub->max_lag         = 0;
+    if (sub->shm_slot >= 0) {
+        shm_release(sub->shm_slot);
+        sub->shm_slot    = -1;
+    }
+    sub->mcast_groups    = 0;
+    sub->lvc_gen         = 0;
+    sub->batch_due       = 0; //batch_held stays, it says whether it is listed
+    wheel_unlink(slot);
+    atomic_store(&sub->state, SUB_FREE);
+    free_slots[free_count++] = slot;
+    pthread_mutex_unlock(&subs_lock);
+}
+
+// Release a CLOSING slot once the routing loop can no longer be queuing to
+// it: it was asleep, or finished a batch, after we saw the slot CLOSING.
+// Returns 0 if the sender has to try again later.
+static int try_release_subscriber(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    uint64_t epoch = atomic_load(&router_epoch);
+    if (!sub->release_armed) {
+        sub->release_armed = 1;
+        sub->release_epoch = epoch;
+        if (!atomic_load(&router_sleeping)) {
+            return 0;
+        }
+    } else if (epoch == sub->release_epoch && !atomic_load(&router_sleeping)) {
+        return 0;
+    }
+    sub->release_armed = 0;
+    release_subscriber(slot);
+    return 1;
+}
+
+static void evict_subscriber(int slot, const char *why);
+
+// evict from a sender or the reactor, unless something else got there first
+static void drop_subscriber(int slot, const char *why) {
+    pthread_mutex_lock(&subs_lock);
+    if (atomic_load(&sub_at(slot)->state) == SUB_ACTIVE) {
+        evict_subscriber(slot, why);
+    }
+    pthread_mutex_unlock(&subs_lock);
+}
+
+// Sender side check of a subscriber whose socket is full. Its lag is what
+// sits in its queue plus what the kernel has not sent yet (TIOCOUTQ).
+// drop-oldest trims the queue back to lag_limit so the newest frames stay,
+// disconnect evicts it once the whole lag is past lag_limit.
+// the other policies are applied by the router.
+static void sender_backpressure(int slot) {
+    subscriber_t *sub = sub_at(slot);
+    uint64_t queued = queue_bytes(&sub->queue);
+    int unsent = 0;
+    if (ioctl(sub->tcp_sock, TIOCOUTQ, &unsent) < 0) {
+        unsent = 0;
+    }
+    uint64_t lag = queued + unsent;
+    atomic_store(&sub->lag_bytes, lag);
+    if (lag > atomic_load(&sub->max_lag)) {
+        atomic_store(&sub->max_lag, lag);
+    }
+    if (sub->policy == BP_DROP_OLDEST && queued > sub->lag_limit) {
+        int dropped = queue_drop_oldest(&sub->queue, queued - sub->lag_limit);
+        atomic_fetch_add(&sub->dropped, dropped);
+        atomic_fetch_add(&pub_error, dropped);
+    } else if (sub->policy == BP_DISCONNECT && lag > sub->lag_limit &&
+               !atomic_load(&sub->queue.replaying)) {
+        char why[64];
+        snprintf(why, sizeof(why), "lagging %lu bytes behind", (unsigned long)lag);
+        drop_subscriber(slot, why);
+    }
+}
+
+static void sender_defer(deferred_t *d, int slot);
+
+// keep a slot's frames back until due, the sender's timer goes off by then
+static void sender_hold(sender_t *self, int slot, uint64_t due) {
+    subscriber_t *sub = sub_at(slot);
+    if (!sub->batch_held) {
+        sub->batch_held = 1;
+        sender_defer(&self->held, slot);
+    }
+    if (!self->timer_due || due < self->timer_due) {
+        struct itimerspec at = {
+            .it_value = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 },
+        };
+        if (timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &at, NULL) < 0) {
+            perror("[PUB] sender timerfd");
+        }
+        self->timer_due = due;
+    }
+}
+
+// Flush one slot the sender was pointed at. Each socket sits in the
+// sender's epoll set from its first pass here, edge triggered for
+// writability and hangup, so a full socket only has to be marked blocked.
+// Returns 0 for a CLOSING slot that has to be looked at again later
+static int sender_service(sender_t *self, int slot) {
+    subscriber_t *sub = sub_at(slot);
+    int state = atomic_load(&sub->state);
+    if (state == SUB_CLOSING) {
+        return try_release_subscriber(slot);
+    }
+    if (state != SUB_ACTIVE) {
+        return 1;
+    }
+    if (!sub->watched) {
+        struct epoll_event ev = {
+            .events = EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.u32 = slot,
+        };
+        if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, sub->tcp_sock, &ev) < 0) {
+            perror("[PUB] sender epoll_ctl");
+        }
+        sub->watched = 1;
+    }
+    if (sub->blocked) {
+        sender_backpressure(slot); //router queued more while the socket is full
+        return 1;
+    }
+    uint64_t due = batch_hold(sub);
+    if (due) {
+        sender_hold(self, slot, due);
+        return 1;
+    }
+    int full = flush_subscriber(sub);
+    if (full < 0) {
+        drop_subscriber(slot, "connection lost");
+        return 1;
+    }
+    if (!full) {
+        atomic_store(&sub->lag_bytes, 0);
+        return 1;
+    }
+    sender_backpressure(slot);
+    sub->blocked = 1; //the next EPOLLOUT edge clears it
+    return 1;
+}
+
+// remember a slot to come back to, a CLOSING one on the next pass
+static void sender_defer(deferred_t *d, int slot) {
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 16;
+        int *grown = realloc(d->slots, cap * sizeof(int));
+        if (!grown) {
+            perror("[PUB] sender realloc");
+            return;
+        }
+        d->slots = grown;
+        d->cap = cap;
+    }
+    d->slots[d->count++] = slot;
+}
+
+// Sender worker: owns the slots where slot % SENDER_THREADS == id.
+// Only uses non-blocking sends. It sleeps in epoll_wait on its eventfd and
+// its subscribers' sockets, and only touches slots that the router
+// scheduled, became writable or hung up, so idle subscribers cost nothing.
+void *sender_thread(void *arg) {
+    sender_t *self = (sender_t *)arg;
+    struct epoll_event events[SENDER_EVENTS];
+    deferred_t deferred = {0}; //CLOSING slots waiting on the router
+
+    struct epoll_event wake = { .events = EPOLLIN, .data.u32 = UINT32_MAX };
+    struct epoll_event timer = { .events = EPOLLIN, .data.u32 = UINT32_MAX - 1 };
+    if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->event_fd, &wake) < 0 ||
+        epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->timer_fd, &timer) < 0) {
+        perror("[PUB] sender epoll_ctl");
+        return NULL;
+    }
+
+    while (1) {
+        int retry = deferred.count;
+        deferred.count = 0;
+        for (int i = 0; i < retry; i++) {
+            if (!sender_service(self, deferred.slots[i])) {
+                deferred.slots[deferred.count++] = deferred.slots[i];
+            }
+        }
+
+        for (int slot = sender_take(self); slot >= 0; ) {
+            int next = sender_next(slot);
+            if (!sender_service(self, slot)) {
+                sender_defer(&deferred, slot);
+            }
+            slot = next;
+        }
+
+        // go to sleep, then look once more so a wakeup can't be missed
+        atomic_store(&self->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&self->ready) >= 0) {
+            atomic_store(&self->sleeping, 0);
+            continue;
+        }
+
+        int n = epoll_wait(self->epoll_fd, events, SENDER_EVENTS, deferred.count ? 1 : 1000);
+        int expired = 0;
+        if (n < 0 && errno != EINTR) {
+            perror("[PUB] sender epoll_wait");
+        }
+        atomic_store(&self->sleeping, 0);
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u32 == UINT32_MAX) {
+                uint64_t count;
+                if (read(self->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("[PUB] sender eventfd");
+                }
+                continue;
+            }
+            if (events[e].data.u32 == UINT32_MAX - 1) {
+                uint64_t count;
+                if (read(self->timer_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("[PUB] sender timerfd");
+                }
+                expired = 1;
+                continue;
+            }
+            int slot = events[e].data.u32;
+            if (events[e].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // peer closed, reset, or keepalive/user timeout gave up
+                drop_subscriber(slot, "hung up");
+            } else {
+                sub_at(slot)->blocked = 0; //writable again
+            }
+            if (!sender_service(self, slot)) {
+                sender_defer(&deferred, slot);
+            }
+        }
+        // look at every held slot again, the ones still short of their
+        // deadline and batch_bytes go back on the list and set the timer
+        if (expired) {
+            int held = self->held.count;
+            self->held.count = 0;
+            self->timer_due = 0;
+            for (int i = 0; i < held; i++) {
+                int slot = self->held.slots[i];
+                sub_at(slot)->batch_held = 0;
+                if (!sender_service(self, slot)) {
+                    sender_defer(&deferred, slot);
                 }
             }
         }
-        pthread_mutex_unlock(&subs_lock);
     }
-
+    return NULL;
 }
 
-void* microservice_listener_thread(void* arg){
-    //act as client - receive message from server
-
-    printf("microservice listener started\n");
+// act as client - connect to the microservice feed
+int connect_to_microservice(){
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd < 0){
         fprintf(stderr, "Thread failed to create socket: %s\n",strerror(errno));
+        return -1;
     }
     struct sockaddr_in ms_addr;
     ms_addr.sin_family = AF_INET;
     ms_addr.sin_port = htons(MICROSERVICE_PORT);
     ms_addr.sin_addr.s_addr = INADDR_ANY;
-    int addrlen = sizeof(ms_addr);
 
-    int conn = connect(sockfd, (struct sockaddr*) &ms_addr, sizeof(ms_addr));
-    char inbuf[1024];
-    if(conn < 0){
+    if(connect(sockfd, (struct sockaddr*) &ms_addr, sizeof(ms_addr)) < 0){
         fprintf(stderr, "Microservice thread failed to connect: %s\n",strerror(errno));
+        close(sockfd);
+        return -1;
     }
-    else {
+    return sockfd;
+}
+
+void* microservice_listener_thread(void* arg){
+    //act as client - receive message from server
+
+    printf("microservice listener started\n");
+    int sockfd = connect_to_microservice();
+    if(sockfd >= 0){
         *(int*)arg = sockfd;
         microservice_fd = sockfd;
-        if(pipe(pipe_fds) < 0){
-            fprintf(stderr,"Pipe failed: %s\n",strerror(errno));
-            exit(1);
-        }
         while(1){
-            int recvbytes = recv(sockfd, microservice_message, sizeof(inbuf), MSG_DONTWAIT);
-            if(recvbytes < 0){
-                // fprintf(stderr, "Thread failed to receive: %s\n",strerror(errno));
+            ingest_buf_t *buf;
+            while (!(buf = ingest_ring_pop(&ingest_free))) {
+                sched_yield(); //routing loop holds every buffer
             }
-            if(write(pipe_fds[1],microservice_message,strlen(microservice_message)) < 0){
-                fprintf(stderr, "Thread failed to write to ms fd: %s\n",strerror(errno));
+            int recvbytes = recv(sockfd, buf->data, sizeof(buf->data) - 1, 0);
+            if(recvbytes <= 0){
+                ingest_ring_push(&ingest_free, buf);
+                if(recvbytes < 0 && errno == EINTR){
+                    continue;
+                }
+                if(recvbytes < 0){
+                    fprintf(stderr, "Thread failed to receive: %s\n",strerror(errno));
+                }
+                break;
             }
-            memset(microservice_message, 0, 1024);
+            buf->len = recvbytes;
+            ingest_ring_push(&ingest_ready, buf);
+            ingest_wake();
         }
     }
     // char inbuf[1024];
@@ -268,86 +2907,430 @@ void* microservice_listener_thread(void* arg){
 }
 
 
-// Broadcast listen (UDP) for heartbeats.
-// Using heartbeats to determine each subscribers topics
-void *subscription_listener_thread(void *arg) {
-    subs_t *subset = (subs_t *)arg;
-    int hb_sock = subset->socket;
-    subscriber_t *subs = subset->subs;
+// "#" may only be the last segment of a pattern
+static int topic_pattern_valid(const char *pattern) {
+    const char *hash = strstr(pattern, "#");
+    if (!hash) {
+        return 1;
+    }
+    return (hash == pattern || hash[-1] == ':') && hash[1] == '\0';
+}
 
-    struct sockaddr_in src_addr;
-    socklen_t addr_len;
-    char hb_buffer[512];
+// Expand one heartbeat topic entry into patterns, appended to list.
+// "{toplevel:child1,child2:grand4}" is toplevel:child1 and
+// toplevel:child2:grand4, "{toplevel}" is toplevel, anything else is
+// taken as it is. Returns the new count
+static int topic_pattern_expand(const char *entry, char **list, int count, int cap) {
+    char buf[MAX_TOPIC_LEN];
+    size_t len = strnlen(entry, MAX_TOPIC_LEN - 1);
+    memcpy(buf, entry, len);
+    buf[len] = '\0';
+
+    const char *head = buf;
+    char *alts = NULL;
+    if (len >= 2 && buf[0] == '{' && buf[len - 1] == '}') {
+        buf[len - 1] = '\0';
+        head = buf + 1;
+        if ((alts = strchr(buf + 1, ':'))) {
+            *alts++ = '\0';
+        }
+    }
 
-    printf("[PUB] Heartbeat listener thread started.\n");
-    while (1) {
-        addr_len = sizeof(src_addr);
-        int bytes = recvfrom(hb_sock, hb_buffer, sizeof(hb_buffer) - 1, 0,
-                             (struct sockaddr *)&src_addr, &addr_len);
+    char *save = NULL;
+    char *alt = alts ? strtok_r(alts, ",", &save) : NULL;
+    do {
+        if (count == cap) {
+            break;
+        }
+        char pattern[MAX_TOPIC_LEN * 2];
+        snprintf(pattern, sizeof(pattern), alt ? "%s:%s" : "%s", head, alt);
+        if (!topic_pattern_valid(pattern)) {
+            printf("[PUB] Ignoring topic pattern '%s', '#' has to come last\n", pattern);
+        } else if ((list[count] = strndup(pattern, MAX_TOPIC_LEN - 1))) {
+            count++;
+        }
+    } while (alt && (alt = strtok_r(NULL, ",", &save)));
+    return count;
+}
 
-        if (bytes < 0) {
-            perror("[PUB] recvfrom error");
-            sleep(1);
-            continue;
+// Replace a slot's topic list with entries (count strings, taken over by
+// the slot), moving only the changed patterns in the index.
+// Heartbeat entries are expanded into patterns here, once, so the router only
+// ever sees them compiled into the trie.
+// Called with subs_lock held, inside a table write section.
+static void update_subscriber_topics(int slot, char **topics, int count) {
+    subscriber_t *sub = sub_at(slot);
+    char **fresh = NULL;
+    int kept_count = 0;
+    int cap = count * (MAX_TOPIC_LEN / 2); // an entry has at most that many alternatives
+
+    if (count && !(fresh = calloc(cap, sizeof(char *)))) {
+        perror("[PUB] topic list calloc");
+        for (int t = 0; t < count; t++) {
+            free(topics[t]);
+        }
+        free(topics);
+        return; //keep the old list
+    }
+    for (int t = 0; t < count; t++) {
+        kept_count = topic_pattern_expand(topics[t], fresh, kept_count, cap);
+    }
+    if (fresh && kept_count < cap) {
+        char **shrunk = realloc(fresh, (kept_count ? kept_count : 1) * sizeof(char *));
+        fresh = shrunk ? shrunk : fresh;
+    }
+
+    // drop topics that are gone
+    for (int o = 0; o < sub->topic_count; o++) {
+        int kept = 0;
+        for (int t = 0; t < kept_count && !kept; t++) {
+            kept = strcmp(sub->topics[o], fresh[t]) == 0;
+        }
+        if (!kept) {
+            topic_index_remove(sub->topics[o], slot);
+        }
+    }
+    // add topics that are new
+    for (int t = 0; t < kept_count; t++) {
+        int known = 0;
+        for (int o = 0; o < sub->topic_count && !known; o++) {
+            known = strcmp(sub->topics[o], fresh[t]) == 0;
         }
-        else if (bytes == 0) {
-            //ignore
-            continue; 
+        if (!known) {
+            topic_index_add(fresh[t], slot);
         }
+    }
+
+    for (int o = 0; o < sub->topic_count; o++) {
+        free(sub->topics[o]);
+    }
+    free(sub->topics);
+    for (int o = 0; o < sub->entry_count; o++) {
+        free(sub->entries[o]);
+    }
+    free(sub->entries);
+    sub->entries        = topics;
+    sub->entry_count    = count;
+    sub->topics         = fresh;
+    sub->topic_count    = kept_count;
+    sub->topic_received = (kept_count > 0);
+    // a group pattern it dropped comes back to TCP, if it subscribes again
+    sub->mcast_groups  &= mcast_membership(sub);
+}
 
-        //extract heartbeat
-        heartbeat_t *hb = (heartbeat_t*)hb_buffer;
-        uint32_t sender_ip = src_addr.sin_addr.s_addr;
-        uint16_t sender_port = ntohs(hb->advertised_port);
-        uint32_t sub_id = ntohl(hb->system_id);  
-        uint16_t count = ntohs(hb->topic_count);
+// Build a slot's next topic list from a FULL or DELTA heartbeat's records.
+// Returns the number of entries in *out, -1 when the beat is malformed
+static int heartbeat_topics(subscriber_t *sub, const heartbeat_t *hb, int bytes, char ***out) {
+    const uint8_t *rec = (const uint8_t *)(hb + 1);
+    const uint8_t *end = (const uint8_t *)hb + bytes;
+    int base = hb->type == HB_DELTA ? sub->entry_count : 0;
+    char **list = calloc(base + hb->count + 1, sizeof(char *));
+    int count = 0;
+    if (!list) {
+        perror("[PUB] topic list calloc");
+        return -1;
+    }
+    for (int t = 0; t < base; t++) {
+        if ((list[count] = strdup(sub->entries[t]))) {
+            count++;
+        }
+    }
 
-        //check in subscriber array
-        int slot = -1;
-        for (int i = 0; i < MAX_SUBS; i++) {
-            if (subs[i].ip_addr == sender_ip && subs[i].subscriber_id == sub_id) {
-                slot = i; //already exists
-                break;
+    for (int r = 0; r < hb->count; r++) {
+        if (end - rec < 2 || end - rec < 2 + rec[1]) {
+            for (int t = 0; t < count; t++) {
+                free(list[t]);
+            }
+            free(list);
+            return -1; //truncated record
+        }
+        int op = rec[0];
+        size_t len = rec[1] < MAX_TOPIC_LEN ? rec[1] : MAX_TOPIC_LEN - 1;
+        const char *topic = (const char *)rec + 2;
+        rec += 2 + rec[1];
+
+        int at = -1;
+        for (int t = 0; t < count && at < 0; t++) {
+            if (strlen(list[t]) == len && memcmp(list[t], topic, len) == 0) {
+                at = t;
             }
-            if (slot < 0 && subs[i].ip_addr == 0) {
-                slot = i; //new subscriber
+        }
+        if (op == HB_REMOVE && at >= 0) {
+            free(list[at]);
+            list[at] = list[--count];
+        } else if (op == HB_ADD && at < 0 && len && count < max_topics) {
+            if ((list[count] = strndup(topic, len))) {
+                count++;
             }
         }
-        if (slot < 0) {
-            continue; //if no free slots ignore
+    }
+    *out = list;
+    return count;
+}
+
+// tell a subscriber we could not apply its beat, it answers with HB_FULL
+static void heartbeat_nak(const heartbeat_t *hb, struct sockaddr_in *src_addr, uint32_t have) {
+    heartbeat_t nak = {
+        .version = HB_VERSION,
+        .type = HB_NAK,
+        .system_id = hb->system_id,
+        .epoch = htonl(have),
+    };
+    if (sendto(heartbeat_fd, &nak, sizeof(nak), MSG_DONTWAIT,
+               (struct sockaddr *)src_addr, sizeof(*src_addr)) < 0) {
+        perror("[PUB] heartbeat nak");
+    }
+}
+
+// A member of one of our multicast groups missed messages, resend them on
+// its TCP stream. Returns the slot, -1 when it was not for us
+static int heartbeat_repair(int slot, const heartbeat_t *hb, int bytes) {
+    mcast_repair_t req;
+    if (slot < 0 || bytes < (int)(sizeof(*hb) + sizeof(req))) {
+        return -1;
+    }
+    memcpy(&req, hb + 1, sizeof(req));
+    int g = ntohs(req.group);
+    subscriber_t *sub = sub_at(slot);
+    if (ntohl(req.source) != mcast_source || g >= mcast_count ||
+        atomic_load(&sub->state) != SUB_ACTIVE) {
+        return -1; //another publisher's group
+    }
+    if (mcast_repair(&sub->queue, g, be64toh(req.from), be64toh(req.to)) &&
+        sender_schedule(slot) >= 0) {
+        sender_wake(&senders[slot % sender_count]);
+    }
+    return slot;
+}
+
+// Apply one heartbeat datagram to the subscriber table.
+// A ping from a known subscriber only refreshes its timestamp, no lock.
+// Returns the slot it went to, -1 when it was ignored
+int handle_heartbeat(char *hb_buffer, int bytes, struct sockaddr_in *src_addr) {
+    //extract heartbeat
+    heartbeat_t *hb = (heartbeat_t*)hb_buffer;
+    if (bytes < (int)sizeof(heartbeat_t) || hb->version != HB_VERSION ||
+        (hb->type > HB_DELTA && hb->type != HB_REPAIR)) {
+        return -1; //runt, or not a beat we understand
+    }
+    uint32_t sender_ip = src_addr->sin_addr.s_addr;
+    uint16_t sender_port = ntohs(hb->advertised_port);
+    uint32_t sub_id = ntohl(hb->system_id);  
+    uint32_t epoch = ntohl(hb->epoch);
+
+    //check in subscriber table
+    int slot = sub_lookup(sender_ip, sender_port, sub_id);
+    if (hb->type == HB_REPAIR) {
+        return heartbeat_repair(slot, hb, bytes);
+    }
+    if (slot >= 0) {
+        subscriber_t *sub = sub_at(slot);
+        if (atomic_load(&sub->state) != SUB_ACTIVE) {
+            return -1; //old connection still being torn down
+        }
+        atomic_store(&sub->last_heartbeat, wheel_tick());
+        if (epoch == sub->epoch && hb->type != HB_FULL) {
+            return slot; //nothing changed, or a delta we already have
+        }
+        if (hb->type == HB_PING || (hb->type == HB_DELTA && epoch != sub->epoch + 1)) {
+            heartbeat_nak(hb, src_addr, sub->epoch); //missed a delta
+            return slot;
+        }
+        char **entries;
+        int count = heartbeat_topics(sub, hb, bytes, &entries);
+        if (count < 0) {
+            return -1;
         }
-        // Update heartbeat timestamp
         pthread_mutex_lock(&subs_lock);
-        subs[slot].ip_addr = sender_ip;
-        subs[slot].port = sender_port;
-        subs[slot].last_heartbeat = time(NULL);
+        table_write_begin();
+        update_subscriber_topics(slot, entries, count);
+        sub->epoch = epoch;
+        table_write_end();
+        pthread_mutex_unlock(&subs_lock);
+        return slot;
+    }
 
-         // fill in new subscriber struct topic details
-        for (int t = 0; t < count; t++) {
-            strncpy(subs[slot].topics[t],
-                    hb->topics[t],
-                    MAX_TOPIC_LEN);
-            subs[slot].topics[t][MAX_TOPIC_LEN-1] = '\0';
-        }
-        subs[slot].topic_count    = count;
-        subs[slot].topic_received = (count > 0);
-
-        // If this is a new subscriber, connect (TCP)
-        if (subs[slot].tcp_sock < 0) {
-            int sock = connect_to_subscriber(sender_ip, sender_port);
-            if (sock >= 0) {
-                subs[slot].tcp_sock = sock;
-                subs[slot].subscriber_id = sub_id;
-                printf("[PUB] Connected to subscriber %s:%u on %d topics\n",
-                       inet_ntoa(*(struct in_addr *)&sender_ip),
-                       subs[slot].port,
-                       count);
-            } else {
-                printf("[PUB] Failed to connect to %s\n",
-                       inet_ntoa(*(struct in_addr *)&sender_ip));
+    // a new subscriber has to tell us its whole list first
+    if (hb->type != HB_FULL) {
+        heartbeat_nak(hb, src_addr, 0);
+        return -1;
+    }
+    pthread_mutex_lock(&subs_lock);
+    slot = sub_alloc();
+    pthread_mutex_unlock(&subs_lock);
+    if (slot < 0) {
+        // table is at max_subs, say so once a second
+        static time_t full_reported;
+        time_t now = time(NULL);
+        if (now != full_reported) {
+            full_reported = now;
+            printf("[PUB] Subscriber table full (%d), ignoring %s\n", max_subs,
+                   inet_ntoa(*(struct in_addr *)&sender_ip));
+        }
+        return -1;
+    }
+    subscriber_t *sub = sub_at(slot);
+    char **entries;
+    int count = heartbeat_topics(sub, hb, bytes, &entries);
+    // connect (TCP) before taking the lock
+    int sock = count < 0 ? -1 : connect_to_subscriber(sender_ip, sender_port);
+    // and find where its replay starts, if it asked for one
+    int64_t replay = sock < 0 ? -1 : log_resume(hb, bytes);
+    if (sock < 0) {
+        if (count >= 0) {
+            printf("[PUB] Failed to connect to %s\n",
+                   inet_ntoa(*(struct in_addr *)&sender_ip));
+            for (int t = 0; t < count; t++) {
+                free(entries[t]);
             }
+            free(entries);
         }
+        pthread_mutex_lock(&subs_lock);
+        free_slots[free_count++] = slot;
         pthread_mutex_unlock(&subs_lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&subs_lock);
+    sub->ip_addr = sender_ip;
+    sub->subscriber_id = sub_id;
+    sub->port = sender_port;
+    sub->last_heartbeat = wheel_tick();
+    wheel_insert(slot, sub->last_heartbeat + SUBSCRIBER_TIMEOUT * 1000 / WHEEL_TICK_MS);
+    // backpressure is picked at subscribe time
+    sub->policy = hb->policy < BP_COUNT ? hb->policy : BP_DROP_NEWEST;
+    sub->lag_limit = ntohl(hb->lag_limit) ? ntohl(hb->lag_limit) : DEFAULT_LAG_LIMIT;
+    sub_hash_insert(slot, sender_ip, sender_port, sub_id);
+
+     // fill in new subscriber struct topic details
+    table_write_begin();
+    update_subscriber_topics(slot, entries, count);
+    sub->epoch = epoch;
+    sub->tcp_sock = sock;
+    // everything logged before it shows up to the router comes from the log
+    // what it subscribed to now picks the records
+    uint64_t replay_end = atomic_load(&log_end);
+    char **replay_topics = NULL;
+    if (replay >= 0 && (uint64_t)replay < replay_end && sub->topic_count &&
+        (replay_topics = calloc(sub->topic_count, sizeof(char *)))) {
+        sub->queue.replay_topic_count = 0;
+        for (int t = 0; t < sub->topic_count; t++) {
+            if ((replay_topics[sub->queue.replay_topic_count] = strdup(sub->topics[t]))) {
+                sub->queue.replay_topic_count++;
+            }
+        }
+        sub->queue.replay_topics = replay_topics;
+        sub->queue.replay_pos = replay;
+        sub->queue.replay_run = replay;
+        sub->queue.replay_end = replay_end;
+        atomic_store(&sub->queue.replaying, 1);
+    } else if (replay >= 0) {
+        log_reader_done();
+        replay = -1;
+    }
+    // without a replay it starts from the current value of its topics.
+    // taken with the router held off, anything newer reaches it live
+    // the router's message in flight may be in it too, lvc_gen stops it
+    // from going out a second time
+    sub->lvc_gen = 0;
+    if (replay < 0 && sub->topic_count) {
+        sub->queue.snapshot = lvc_snapshot(sub->topics, sub->topic_count,
+                                           &sub->queue.snapshot_len, &sub->lvc_gen);
+        sub->queue.snapshot_sent = 0;
+    }
+    // a subscriber on this host that can read the ring takes it from here.
+    // its slot starts at the head, anything older reached it on the stream
+    if (shm_ring && (ntohs(hb->flags) & HB_F_SHM) &&
+        (ntohl(sender_ip) >> 24) == 127 && (sub->shm_slot = shm_claim()) >= 0 &&
+        shm_offer(&sub->queue, sub->shm_slot) < 0) {
+        shm_release(sub->shm_slot);
+        sub->shm_slot = -1;
+    }
+    // one that reads multicast gets its group patterns there
+    if (sub->shm_slot < 0 && mcast_count && (ntohs(hb->flags) & HB_F_MCAST)) {
+        sub->mcast_groups = mcast_membership(sub);
+        for (int g = 0; g < mcast_count; g++) {
+            if ((sub->mcast_groups & (1u << g)) && mcast_offer(&sub->queue, g, sub->lvc_gen) < 0) {
+                sub->mcast_groups &= ~(1u << g);
+            }
+        }
+    }
+    atomic_store(&sub->state, SUB_ACTIVE);
+    table_write_end();
+
+    printf("[PUB] Connected to subscriber %s:%u on %d topics, %s after %u bytes\n",
+           inet_ntoa(*(struct in_addr *)&sender_ip),
+           sub->port,
+           count,
+           bp_names[sub->policy],
+           sub->lag_limit);
+    if (replay >= 0) {
+        printf("[PUB] Replaying %lu log bytes to %s:%u\n",
+               (unsigned long)(sub->queue.replay_end - sub->queue.replay_pos),
+               inet_ntoa(*(struct in_addr *)&sender_ip), sub->port);
+    } else if (sub->queue.snapshot && sub->shm_slot < 0) {
+        printf("[PUB] Sending %u bytes of last values to %s:%u\n", sub->queue.snapshot_len,
+               inet_ntoa(*(struct in_addr *)&sender_ip), sub->port);
+    }
+    if (sub->shm_slot >= 0) {
+        printf("[PUB] %s:%u reads shared memory slot %d\n",
+               inet_ntoa(*(struct in_addr *)&sender_ip), sub->port, sub->shm_slot);
+    }
+    if (sub->mcast_groups) {
+        printf("[PUB] %s:%u joins %d multicast groups\n", inet_ntoa(*(struct in_addr *)&sender_ip),
+               sub->port, __builtin_popcount(sub->mcast_groups));
+    }
+    pthread_mutex_unlock(&subs_lock);
+    // its sender starts watching the socket for hangups
+    if (sender_schedule(slot) >= 0) {
+        sender_wake(&senders[slot % sender_count]);
+    }
+    return slot;
+}
+
+// heartbeat batch, used by the listener thread or the reactor, never both
+static char hb_buffers[HB_BATCH][HB_MAX_SIZE];
+static struct sockaddr_in hb_srcs[HB_BATCH];
+static struct iovec hb_iovs[HB_BATCH];
+static struct mmsghdr hb_msgs[HB_BATCH];
+
+// Receive up to HB_BATCH heartbeats in one recvmmsg and apply them.
+// Returns how many were received, -1 on error (0 when none were waiting)
+static int heartbeat_drain(int hb_sock, int flags) {
+    for (int i = 0; i < HB_BATCH; i++) {
+        hb_iovs[i].iov_base = hb_buffers[i];
+        hb_iovs[i].iov_len = HB_MAX_SIZE;
+        memset(&hb_msgs[i].msg_hdr, 0, sizeof(hb_msgs[i].msg_hdr));
+        hb_msgs[i].msg_hdr.msg_name = &hb_srcs[i];
+        hb_msgs[i].msg_hdr.msg_namelen = sizeof(hb_srcs[i]);
+        hb_msgs[i].msg_hdr.msg_iov = &hb_iovs[i];
+        hb_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(hb_sock, hb_msgs, HB_BATCH, flags, NULL);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (hb_msgs[i].msg_len > 0) {
+            handle_heartbeat(hb_buffers[i], hb_msgs[i].msg_len, &hb_srcs[i]);
+        }
+    }
+    return n;
+}
+
+// Broadcast listen (UDP) for heartbeats.
+// Using heartbeats to determine each subscribers topics
+void *subscription_listener_thread(void *arg) {
+    subs_t *subset = (subs_t *)arg;
+    int hb_sock = subset->socket;
+
+    printf("[PUB] Heartbeat listener thread started.\n");
+    while (1) {
+        // block for the first beat, then take whatever else is queued
+        if (heartbeat_drain(hb_sock, MSG_WAITFORONE) < 0) {
+            perror("[PUB] recvmmsg error");
+            sleep(1);
+        }
     }
 
     printf("[PUB] Exiting heartbeat listener thread.\n");
@@ -355,46 +3338,447 @@ void *subscription_listener_thread(void *arg) {
     return NULL;
 }
 
+// Take an ACTIVE slot out of routing, its sender closes the socket and
+// frees the slot. Called with subs_lock held
+static void evict_subscriber(int slot, const char *why) {
+    subscriber_t *sub = sub_at(slot);
+    struct in_addr in = { .s_addr = sub->ip_addr };
+    printf("[PUB] Unsubscribing %s:%u %s\n", inet_ntoa(in), sub->port, why);
+
+    table_write_begin();
+    for (int t = 0; t < sub->topic_count; t++) {
+        topic_index_remove(sub->topics[t], slot);
+    }
+    atomic_store(&sub->state, SUB_CLOSING);
+    table_write_end();
+    if (sender_schedule(slot) >= 0) {
+        sender_wake(&senders[slot % sender_count]);
+    }
+}
+
+// Run the timer wheel up to tick now and mark subscribers that stopped
+// beating as CLOSING. Only the slots whose bucket comes up are looked at:
+// one that beat since it was filed is filed again at its new deadline
+void expire_subscribers(uint64_t now) {
+    uint64_t timeout = SUBSCRIBER_TIMEOUT * 1000 / WHEEL_TICK_MS;
+    pthread_mutex_lock(&subs_lock);
+    while (wheel_now < now) {
+        uint64_t tick = ++wheel_now;
+        // a level 1 bucket spreads out over level 0 once a turn
+        if (!(tick & (WHEEL_SIZE - 1))) {
+            int *head = &wheel[1][(tick >> WHEEL_BITS) & (WHEEL_SIZE - 1)];
+            while (*head >= 0) {
+                int slot = *head;
+                wheel_unlink(slot);
+                wheel_insert(slot, sub_at(slot)->timer_due);
+            }
+        }
+        int *head = &wheel[0][tick & (WHEEL_SIZE - 1)];
+        while (*head >= 0) {
+            int slot = *head;
+            subscriber_t *sub = sub_at(slot);
+            uint64_t due = atomic_load(&sub->last_heartbeat) + timeout;
+            wheel_unlink(slot);
+            if (atomic_load(&sub->state) != SUB_ACTIVE) {
+                continue; //already on its way out
+            }
+            if (due > tick) {
+                wheel_insert(slot, due);
+            } else {
+                evict_subscriber(slot, "due to inactivity");
+            }
+        }
+    }
+    pthread_mutex_unlock(&subs_lock);
+}
+
 void *subscriber_cleanup_thread(void *arg) {
 
     while (1) {
-        sleep(1);
-        time_t now = time(NULL);
+        usleep(WHEEL_TICK_MS * 1000);
+        expire_subscribers(wheel_tick());
+    }
+    return NULL;
+}
+
+// io_uring reactor mode
+// one thread and one ring do what the threads above do: microservice recv,
+// heartbeat recvmsg, the timer wheel tick, a hangup poll per subscriber
+// and every fan-out send. SQEs are
+// queued while handling completions and go to the kernel with one
+// io_uring_submit_and_wait per loop iteration.
+// subscriber queues are still used, with the reactor as their only consumer,
+// and each subscriber has at most one send in flight (its blocked flag).
+// the router schedules slots on senders[0], which the reactor drains.
+#define REACTOR_QUEUE_DEPTH 4096
+
+#define EV_INGEST    1
+#define EV_HEARTBEAT 2
+#define EV_TICK      3
+#define EV_SEND      4
+#define EV_HUP       5
+#define EV_BATCH     6
+#define EV_CLOSE     7 // poll_remove done, the "slot" is the fd to close
+#define EV_DATA(type, slot) (((uint64_t)(type) << 32) | (uint32_t)(slot))
+
+typedef struct {
+    struct io_uring ring;
+    int ms_fd;
+    int hb_sock;
+    char ingest[INGEST_BUFFER_SIZE];
+    ingest_parser_t parser;
+    char hb_buffer[HB_MAX_SIZE];
+    struct sockaddr_in hb_src;
+    struct iovec hb_iov;
+    struct msghdr hb_msg;
+    struct __kernel_timespec tick;
+    struct reactor_io **io;        // per slot sendmsg state, allocated on first send
+    deferred_t held;               // slots holding frames back for a fuller batch
+    struct __kernel_timespec batch_wait;
+    int batch_armed;               // a timeout for the first of held is in flight
+} reactor_t;
+
+typedef struct reactor_io {
+    struct msghdr msg;
+    struct iovec iov[FLUSH_IOV];
+} reactor_io_t;
+
+static struct io_uring_sqe *reactor_sqe(reactor_t *r) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+    if (!sqe) {
+        // SQ ring full, push what we have and try again
+        io_uring_submit(&r->ring);
+        sqe = io_uring_get_sqe(&r->ring);
+    }
+    return sqe;
+}
+
+static void reactor_arm_ingest(reactor_t *r) {
+    struct io_uring_sqe *sqe = reactor_sqe(r);
+    io_uring_prep_recv(sqe, r->ms_fd, r->ingest, sizeof(r->ingest), 0);
+    io_uring_sqe_set_data64(sqe, EV_DATA(EV_INGEST, 0));
+}
+
+static void reactor_arm_heartbeat(reactor_t *r) {
+    struct io_uring_sqe *sqe = reactor_sqe(r);
+    r->hb_iov.iov_base = r->hb_buffer;
+    r->hb_iov.iov_len = sizeof(r->hb_buffer);
+    memset(&r->hb_msg, 0, sizeof(r->hb_msg));
+    r->hb_msg.msg_name = &r->hb_src;
+    r->hb_msg.msg_namelen = sizeof(r->hb_src);
+    r->hb_msg.msg_iov = &r->hb_iov;
+    r->hb_msg.msg_iovlen = 1;
+    io_uring_prep_recvmsg(sqe, r->hb_sock, &r->hb_msg, 0);
+    io_uring_sqe_set_data64(sqe, EV_DATA(EV_HEARTBEAT, 0));
+}
+
+static void reactor_arm_tick(reactor_t *r) {
+    struct io_uring_sqe *sqe = reactor_sqe(r);
+    r->tick.tv_sec = 0;
+    r->tick.tv_nsec = WHEEL_TICK_MS * 1000000L;
+    io_uring_prep_timeout(sqe, &r->tick, 0, 0);
+    io_uring_sqe_set_data64(sqe, EV_DATA(EV_TICK, 0));
+}
+
+// keep a slot's frames back until due. Every hold waits batch_delay_ns, so
+// the timeout in flight is never later than a new one would be
+static void reactor_hold(reactor_t *r, int slot, uint64_t due) {
+    subscriber_t *sub = sub_at(slot);
+    if (!sub->batch_held) {
+        sub->batch_held = 1;
+        sender_defer(&r->held, slot);
+    }
+    if (!r->batch_armed) {
+        uint64_t now = monotonic_ns();
+        uint64_t wait = due > now ? due - now : 0;
+        struct io_uring_sqe *sqe = reactor_sqe(r);
+        r->batch_wait.tv_sec = wait / 1000000000;
+        r->batch_wait.tv_nsec = wait % 1000000000;
+        io_uring_prep_timeout(sqe, &r->batch_wait, 0, 0);
+        io_uring_sqe_set_data64(sqe, EV_DATA(EV_BATCH, 0));
+        r->batch_armed = 1;
+    }
+}
+
+// the first deadline came, hand every held slot back to the ready list,
+// the ones still short of theirs are held again
+static void reactor_batch_done(reactor_t *r) {
+    r->batch_armed = 0;
+    for (int i = 0; i < r->held.count; i++) {
+        sub_at(r->held.slots[i])->batch_held = 0;
+        sender_schedule(r->held.slots[i]);
+    }
+    r->held.count = 0;
+}
+
+// queue one sendmsg covering every frame pending for a subscriber
+static void reactor_send(reactor_t *r, int slot) {
+    subscriber_t *sub = sub_at(slot);
+    if (!r->io[slot] && !(r->io[slot] = malloc(sizeof(reactor_io_t)))) {
+        perror("reactor malloc");
+        return;
+    }
+    reactor_io_t *io = r->io[slot];
+    int count = queue_gather(&sub->queue, io->iov, FLUSH_IOV);
+    if (!count) {
+        return;
+    }
+    memset(&io->msg, 0, sizeof(io->msg));
+    io->msg.msg_iov = io->iov;
+    io->msg.msg_iovlen = count;
+
+    struct io_uring_sqe *sqe = reactor_sqe(r);
+    io_uring_prep_sendmsg(sqe, sub->tcp_sock, &io->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, EV_DATA(EV_SEND, slot));
+    sub->blocked = 1;
+}
+
+// multishot poll that completes when the subscriber hangs up or its
+// connection fails
+static void reactor_watch(reactor_t *r, int slot) {
+    subscriber_t *sub = sub_at(slot);
+    struct io_uring_sqe *sqe = reactor_sqe(r);
+    io_uring_prep_poll_multishot(sqe, sub->tcp_sock, POLLRDHUP);
+    io_uring_sqe_set_data64(sqe, EV_DATA(EV_HUP, slot));
+    sub->watched = 1;
+}
+
+static void reactor_hup(reactor_t *r, int slot, int res, unsigned flags) {
+    subscriber_t *sub = sub_at(slot);
+    if (res < 0 || atomic_load(&sub->state) != SUB_ACTIVE) {
+        return; //cancelled on release
+    }
+    // the slot may belong to a new subscriber by now, ask its socket
+    struct pollfd pfd = { .fd = sub->tcp_sock, .events = POLLRDHUP };
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        drop_subscriber(slot, "hung up");
+    } else if (!(flags & IORING_CQE_F_MORE)) {
+        reactor_watch(r, slot);
+    }
+}
+
+// a released socket is only closed once its hangup poll lets go of it
+// (EV_CLOSE), so its fd number can't be reused under a poll still armed
+static void reactor_release(reactor_t *r, int slot) {
+    subscriber_t *sub = sub_at(slot);
+    if (sub->watched) {
+        struct io_uring_sqe *sqe = reactor_sqe(r);
+        io_uring_prep_poll_remove(sqe, EV_DATA(EV_HUP, slot));
+        io_uring_sqe_set_data64(sqe, EV_DATA(EV_CLOSE, sub->tcp_sock));
+        sub->tcp_sock = -1;
+    }
+    release_subscriber(slot);
+}
+
+static void reactor_send_done(reactor_t *r, int slot, int res) {
+    subscriber_t *sub = sub_at(slot);
+    sub_queue_t *q = &sub->queue;
+    int pending = queue_pending(q);
+
+    sub->blocked = 0;
+    if (pending && res > 0) {
+        queue_consume(q, res);
+    } else if (pending && res != -EAGAIN && res != -EINTR) {
+        atomic_fetch_add(&pub_error, 1);
+        drop_subscriber(slot, "connection lost");
+    }
+
+    // more piled up while the send was out, check how far behind it is
+    if (atomic_load(&sub->state) == SUB_ACTIVE && queue_peek(q)) {
+        sender_backpressure(slot);
+    }
+    if (atomic_load(&sub->state) == SUB_CLOSING) {
+        reactor_release(r, slot);
+    } else if (queue_pending(q)) {
+        sender_schedule(slot);
+    }
+}
+
+void run_reactor(int hb_sock) {
+    reactor_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        perror("reactor calloc");
+        exit(1);
+    }
+    r->hb_sock = hb_sock;
+    r->io = calloc(max_subs, sizeof(*r->io));
+    if (!r->io) {
+        perror("reactor calloc");
+        exit(1);
+    }
+    r->ms_fd = connect_to_microservice();
+    if (r->ms_fd >= 0) {
+        microservice_fd = r->ms_fd;
+    }
 
-        for (int i = 0; i < MAX_SUBS; i++) {
-            subscriber_t *sub = &subs[i];
-            pthread_mutex_lock(&subs_lock);
-            if (sub->tcp_sock >= 0 && (now - sub->last_heartbeat) > SUBSCRIBER_TIMEOUT) {
-                struct in_addr in = { .s_addr = sub->ip_addr };
-                printf("[PUB] Unsubscribing %s:%u due to inactivity\n",
-                       inet_ntoa(in),
-                       sub->port);
+    int ret = io_uring_queue_init(REACTOR_QUEUE_DEPTH, &r->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        exit(1);
+    }
+
+    if (r->ms_fd >= 0) {
+        reactor_arm_ingest(r);
+    }
+    reactor_arm_heartbeat(r);
+    reactor_arm_tick(r);
+    printf("[PUB] io_uring reactor started.\n");
+
+    while (1) {
+        // one send per scheduled subscriber, all submitted together below.
+        // slots with a send in flight are rescheduled when it completes
+        for (int slot = sender_take(&senders[0]); slot >= 0; ) {
+            int next = sender_next(slot);
+            subscriber_t *sub = sub_at(slot);
+            int state = atomic_load(&sub->state);
+            if (state == SUB_CLOSING && !sub->blocked) {
+                reactor_release(r, slot);
+            } else if (state == SUB_ACTIVE && !sub->blocked) {
+                if (!sub->watched) {
+                    reactor_watch(r, slot);
+                }
+                uint64_t due = batch_hold(sub);
+                if (due) {
+                    reactor_hold(r, slot, due);
+                } else {
+                    reactor_send(r, slot);
+                }
+            }
+            slot = next;
+        }
+
+        ret = io_uring_submit_and_wait(&r->ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            exit(1);
+        }
 
-                close(sub->tcp_sock);
-                sub->tcp_sock        = -1;
-                sub->ip_addr         = 0;
-                sub->port            = 0;
-                sub->subscriber_id   = 0;
-                sub->topic_count     = 0;
-                sub->topic_received  = 0;
-                sub->last_heartbeat  = 0;
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        unsigned seen = 0;
+        io_uring_for_each_cqe(&r->ring, head, cqe) {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            int type = data >> 32;
+            int slot = (uint32_t)data;
+            int res = cqe->res;
+            seen++;
+
+            switch (type) {
+                case EV_INGEST:
+                    if (res > 0) {
+                        uint64_t woken = 0; //no sender threads to wake
+                        ingest_parse(&r->parser, r->ingest, res, &woken);
+                        reactor_arm_ingest(r);
+                    } else if (res == 0) {
+                        puts("microservice exit");
+                        microservice_fd = STDIN_FILENO;
+                    } else {
+                        reactor_arm_ingest(r);
+                    }
+                    break;
+                case EV_HEARTBEAT:
+                    if (res > 0) {
+                        handle_heartbeat(r->hb_buffer, res, &r->hb_src);
+                        // the rest of a burst in one syscall before re-arming
+                        while (heartbeat_drain(r->hb_sock, MSG_DONTWAIT) == HB_BATCH) {
+                        }
+                    }
+                    reactor_arm_heartbeat(r);
+                    break;
+                case EV_TICK:
+                    // evicted slots land on the ready list
+                    expire_subscribers(wheel_tick());
+                    reactor_arm_tick(r);
+                    break;
+                case EV_SEND:
+                    reactor_send_done(r, slot, res);
+                    break;
+                case EV_HUP:
+                    reactor_hup(r, slot, res, cqe->flags);
+                    break;
+                case EV_BATCH:
+                    reactor_batch_done(r);
+                    break;
+                case EV_CLOSE:
+                    close(slot); //removed, or the poll had already ended
+                    break;
             }
-            pthread_mutex_unlock(&subs_lock);
         }
+        io_uring_cq_advance(&r->ring, seen);
     }
-    return NULL;
 }
 
 
-void run_publisher_loop(int server_sock, subscriber_t *subs) {
+void run_publisher_loop(int server_sock) {
 
     while (1) {
         //just handles system input for now
-        handle_messaging(subs);
+        handle_messaging();
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    int opt_c;
+    const char *log_path = NULL;
+    int shm = 0;
+    while ((opt_c = getopt(argc, argv, "n:t:l:sg:i:d:b:")) != -1) {
+        switch (opt_c) {
+            case 'g':
+                if (mcast_add(optarg) < 0) {
+                    fprintf(stderr, "[PUB] bad multicast group %s, want pattern@address:port\n", optarg);
+                    max_subs = 0;
+                }
+                break;
+            case 'i':
+                if (inet_pton(AF_INET, optarg, &mcast_iface) != 1) {
+                    max_subs = 0;
+                }
+                break;
+            case 'd':
+                batch_delay_ns = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'b':
+                batch_bytes = strtoul(optarg, NULL, 10);
+                if (!batch_bytes) {
+                    max_subs = 0;
+                }
+                break;
+            case 's':
+                shm = 1;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'n':
+                max_subs = atoi(optarg);
+                break;
+            case 't':
+                max_topics = atoi(optarg);
+                break;
+            default:
+                max_subs = 0;
+                break;
+        }
+    }
+    if (optind < argc && strcmp(argv[optind], "uring") == 0) {
+        reactor_mode = 1;
+        optind++;
+    }
+    if (optind < argc || max_subs <= 0 || max_topics <= 0 || max_topics > MAX_TOPIC_CAPACITY) {
+        fprintf(stderr, "Usage: %s [-n max_subscribers] [-t max_topics (1-%d)] [-l log_dir] [-s] [-g pattern@group:port] [-i multicast_if] [-d max_delay_us] [-b max_batch_bytes] [uring]\n",
+                argv[0], MAX_TOPIC_CAPACITY);
+        return 1;
+    }
+    if (log_path && log_init(log_path) < 0) {
+        return 1;
+    }
+    if (shm && shm_init() < 0) {
+        return 1;
+    }
+    if (mcast_count && mcast_init() < 0) {
+        return 1;
+    }
+
     // Setup TCP socket for publishing messages
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) {
@@ -428,7 +3812,8 @@ int main() {
     // }
 
     int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT | SO_REUSEADDR | SO_BROADCAST | TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
     // Setup UDP heartbeat socket for listening for subscribers
     int hb_sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -439,6 +3824,8 @@ int main() {
 
     setsockopt(hb_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     setsockopt(hb_sock, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt)); // allow broadcast reception
+    int rcvbuf = HB_RCVBUF;
+    setsockopt(hb_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
     struct sockaddr_in hb_addr = {
         .sin_family = AF_INET,
@@ -451,11 +3838,39 @@ int main() {
         return 1;
     }
     printf("[PUB] Listening for heartbeats on %d...\n", HEARTBEAT_PORT);
-
-    // Initialize subscribers list
-    memset(subs, 0, sizeof(subs));  
-    for (int i = 0; i < MAX_SUBS; i++) {
-        subs[i].tcp_sock = -1;
+    heartbeat_fd = hb_sock;
+
+    // Initialize subscribers list, slots are added as subscribers show up
+    max_subs = (max_subs + SUB_CHUNK - 1) / SUB_CHUNK * SUB_CHUNK;
+    sub_words = max_subs / 64;
+    sub_chunks = calloc(max_subs / SUB_CHUNK, sizeof(*sub_chunks));
+    route_targets = calloc(sub_words, sizeof(uint64_t));
+    route_touched = calloc(sub_words, sizeof(uint32_t));
+    free_slots = malloc(max_subs * sizeof(int));
+    // at least two buckets per slot, chains stay short
+    sub_hash_mask = 1;
+    while (sub_hash_mask < (uint32_t)max_subs * 2) {
+        sub_hash_mask <<= 1;
+    }
+    sub_hash = malloc(sub_hash_mask * sizeof(int));
+    sub_hash_mask--;
+    if (!sub_chunks || !route_targets || !route_touched || !free_slots || !sub_hash) {
+        perror("calloc");
+        return 1;
+    }
+    memset(sub_hash, 0xff, (sub_hash_mask + 1) * sizeof(int)); //-1, empty
+    memset(wheel, 0xff, sizeof(wheel));
+    wheel_now = wheel_tick();
+    // one socket per subscriber, let the fd limit go as high as we may
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    sender_count = reactor_mode ? 1 : SENDER_THREADS;
+    for (int w = 0; w < SENDER_THREADS; w++) {
+        senders[w].id = w;
+        atomic_init(&senders[w].ready, -1);
     }
 
     // Allocate and set up subscription listener
@@ -465,7 +3880,14 @@ int main() {
         return 1;
     }
     subset->socket = hb_sock;
-    subset->subs = subs;
+
+    if (reactor_mode) {
+        run_reactor(hb_sock);
+        free(subset);
+        close(server_sock);
+        close(hb_sock);
+        return 0;
+    }
 
     pthread_t microservice_thread;
 
@@ -475,11 +3897,25 @@ int main() {
         free(subset);
         return 1;
     }
-    microservice_message = calloc(1024,1);
+    // ingest buffers all start out free
+    ingest_ring_init(&ingest_ready);
+    ingest_ring_init(&ingest_free);
+    ingest_event_fd = eventfd(0, 0);
+    if (ingest_event_fd < 0) {
+        perror("ingest eventfd");
+        return 1;
+    }
+    for (int i = 0; i < INGEST_BUFFERS; i++) {
+        ingest_buf_t *buf = malloc(sizeof(ingest_buf_t));
+        if (!buf) {
+            perror("malloc");
+            return 1;
+        }
+        ingest_ring_push(&ingest_free, buf);
+    }
     if (pthread_create(&microservice_thread, NULL, microservice_listener_thread, &microservice_fd) != 0) {
         perror("pthread_create");
         free(subset);
-        free(microservice_message);
         return 1;
     }
     // void* retval;
@@ -489,14 +3925,24 @@ int main() {
     pthread_t cleanup_thread;
     if (pthread_create(&cleanup_thread, NULL, subscriber_cleanup_thread, NULL) != 0) {
         perror("pthread_create cleanup");
-        free(microservice_message);
         exit(1);
     }
 
+    // Start sender workers, one eventfd each for router wakeups
+    for (int w = 0; w < SENDER_THREADS; w++) {
+        senders[w].event_fd = eventfd(0, EFD_NONBLOCK);
+        senders[w].epoll_fd = epoll_create1(0);
+        senders[w].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (senders[w].event_fd < 0 || senders[w].epoll_fd < 0 || senders[w].timer_fd < 0 ||
+            pthread_create(&senders[w].thread, NULL, sender_thread, &senders[w]) != 0) {
+            perror("sender thread");
+            exit(1);
+        }
+    }
+
     pthread_detach(listener_thread); 
-    run_publisher_loop(server_sock, subs);// input publisher loop
+    run_publisher_loop(server_sock);// input publisher loop
 
-    free(microservice_message);
     free(subset);
     close(server_sock);
     close(hb_sock);
@@ -11,26 +11,53 @@
 #include <liburing.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
+#include <errno.h>
 
 #define PORT 5555
-#define MAX_SUBS 64
+#define DEFAULT_MAX_SUBS 65536 // -n, rounded up to a whole SUB_CHUNK
+#define SUB_CHUNK 64 // subscriber ids are added this many at a time, one bitmap word
+#define MAX_SUB_NODES 32 // tree nodes one subscription can name
 #define MAX_TOPIC_LEN 512
 #define MAX_BUFFER_SIZE 1024
 #define HEARTBEAT_PORT 5554
 
 #define QUEUE_DEPTH             256
+#define CQE_BATCH               64  // completions reaped per loop iteration
+#define FIXED_FILES             1024 // registered file table, indexed by fd
+#define SQPOLL_IDLE_MS          1000
+
+#define RING_DEFAULT            0
+#define RING_SQPOLL             1   // kernel thread polls the SQ, no submit syscalls under load
+#define RING_DEFER              2   // completions run only when we wait for them (DEFER_TASKRUN)
 #define READ_SZ                 1024
 
+#define REQ_IOV_MAX             1   // the read buffer, or the slot a write sends
+#define POOL_SLAB               64  // objects carved from one allocation
+#define CACHE_LINE              64
+#define BUF_CLASSES             4
+
+#define WRITE_SLOTS             512 // registered response buffers, one per write in flight
+#define WRITE_SLOT_SZ           1024
+#define HEADER_PREFIX           "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n"
+
 #define EVENT_TYPE_ACCEPT       0
 #define EVENT_TYPE_READ         1
 #define EVENT_TYPE_WRITE        2
 
 #define RESPONSE "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-length:15\r\n\r\nHello, world!\r\n"
 
+// Topic tree. Every node has a bit per subscriber id that subscribed to it,
+// a subscription to a node takes everything under it, so the recipients of
+// a topic are the OR of the bitmaps on its path. A bitmap only grows as far
+// as the highest id that subscribed to the node
 struct topic_tree {
-    int num_children;
     char* topic;
-    struct topic_tree* child[];
+    uint64_t* subs;
+    int sub_words;
+    int num_children;
+    int cap_children;
+    struct topic_tree** child;
 };
 
 /*
@@ -56,227 +83,638 @@ struct request {
     int event_type;     //accept connection, read from fd, write to fd
     int iovec_count;
     int client_socket;      //fd for client socket 
+    int sub_id;             //its slot in subs
+    int slot;               //write slot it sends from, -1 for none
     struct iovec iov[];
 };
 
 typedef struct {
-    int tcp_sock;  // TCP socket file descriptor
-    uint32_t ip_addr; // IP address received via heartbeat
-    char topic[MAX_TOPIC_LEN];
-    int topic_received;
-    time_t last_heartbeat;
+    int tcp_sock;  // TCP socket file descriptor, -1 for a free id
+    char topic[MAX_TOPIC_LEN];  // subscription as it was sent
+    struct topic_tree* nodes[MAX_SUB_NODES]; // nodes its bit is set in
+    int node_count;
 } subscriber_t;
 
 typedef struct {
     int socket; //publisher socket
-    subscriber_t *subs;
 } subs_t;
 
 struct io_uring ring;
+int fixed_files = 0; //sockets are registered with the ring, file index = fd
+char fixed_fd[FIXED_FILES]; //fd is in the file table, others go by plain fd
+// Subscribers by id, in SUB_CHUNK sized chunks that are allocated as
+// subscribers arrive, up to max_subs
+subscriber_t** sub_chunks; // max_subs / SUB_CHUNK entries
+int sub_slots;             // ids allocated so far
+int max_subs = DEFAULT_MAX_SUBS;
+uint64_t* recipients;      // publish scratch, max_subs / 64 words
+
+static inline subscriber_t* sub_at(int id) {
+    return &sub_chunks[id / SUB_CHUNK][id % SUB_CHUNK];
+}
+
+// Allocator for the ring's requests and I/O buffers. Only the thread that
+// owns the ring touches it, so there is no locking. Requests are one size
+// (room for REQ_IOV_MAX iovecs), buffers come in size classes. Objects are
+// carved from cache line aligned slabs and go back on their freelist when
+// a completion is done with them, never back to malloc
+struct free_obj {
+    struct free_obj* next;
+};
+
+static const size_t buf_class_size[BUF_CLASSES] = { 64, 256, 1024, 4096 };
+
+struct ring_pool {
+    struct free_obj* reqs;
+    struct free_obj* bufs[BUF_CLASSES];
+};
+static _Alignas(CACHE_LINE) struct ring_pool pool;
+
+// Responses are written from one registered arena of WRITE_SLOTS slots.
+// Every slot starts with the constant header lines, copied in once at
+// setup, so a response only formats its Content-Length, topic and CRLF
+// behind them and goes out with a single write_fixed
+struct write_slots {
+    char* arena;
+    int free_slots[WRITE_SLOTS];
+    int free_count;
+    int fixed;      //registered with the ring, else plain writes from the same memory
+    unsigned long dropped;  //publishes skipped for want of a slot
+};
+static struct write_slots slots;
+
+//take a new slab, hand out its first object and put the rest on the list
+void* pool_refill(struct free_obj** list, size_t size) {
+    size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    char* slab = aligned_alloc(CACHE_LINE, size * POOL_SLAB);
+    if (!slab) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    for (int i = POOL_SLAB - 1; i > 0; i--) {
+        struct free_obj* obj = (struct free_obj*)(slab + i * size);
+        obj->next = *list;
+        *list = obj;
+    }
+    return slab;
+}
+
+static inline void* pool_get(struct free_obj** list, size_t size) {
+    struct free_obj* obj = *list;
+    if (!obj) {
+        return pool_refill(list, size);
+    }
+    *list = obj->next;
+    return obj;
+}
+
+static inline void pool_put(struct free_obj** list, void* p) {
+    struct free_obj* obj = p;
+    obj->next = *list;
+    *list = obj;
+}
+
+static inline int buf_class(size_t len) {
+    for (int c = 0; c < BUF_CLASSES; c++) {
+        if (len <= buf_class_size[c]) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+//buffers are not zeroed, bigger than the largest class go to malloc
+void* buf_alloc(size_t len) {
+    int c = buf_class(len);
+    if (c < 0) {
+        return malloc(len);
+    }
+    return pool_get(&pool.bufs[c], buf_class_size[c]);
+}
+
+void buf_free(void* p, size_t len) {
+    int c = buf_class(len);
+    if (c < 0) {
+        free(p);
+        return;
+    }
+    pool_put(&pool.bufs[c], p);
+}
+
+struct request* req_alloc(void) {
+    struct request* req = pool_get(&pool.reqs, sizeof(struct request) + REQ_IOV_MAX * sizeof(struct iovec));
+    if (req) {
+        req->iovec_count = 0;
+        req->slot = -1;
+    }
+    return req;
+}
+
+//build the slot arena and register it with the ring, call after io_uring_queue_init
+int write_slots_init(void) {
+    size_t prefix = strlen(HEADER_PREFIX);
+    slots.arena = aligned_alloc(4096, (size_t)WRITE_SLOTS * WRITE_SLOT_SZ);
+    if (!slots.arena) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    for (int i = 0; i < WRITE_SLOTS; i++) {
+        memcpy(slots.arena + (size_t)i * WRITE_SLOT_SZ, HEADER_PREFIX, prefix);
+        slots.free_slots[i] = WRITE_SLOTS - 1 - i;
+    }
+    slots.free_count = WRITE_SLOTS;
+    struct iovec arena = {
+        .iov_base = slots.arena,
+        .iov_len = (size_t)WRITE_SLOTS * WRITE_SLOT_SZ,
+    };
+    int ret = io_uring_register_buffers(&ring, &arena, 1);
+    slots.fixed = ret == 0;
+    if (!slots.fixed) {
+        //e.g. RLIMIT_MEMLOCK too low, the slots still work unregistered
+        printf("[PUB] Could not register write buffers (%s), using plain writes\n", strerror(-ret));
+    }
+    return 0;
+}
+
+static inline int slot_get(void) {
+    return slots.free_count > 0 ? slots.free_slots[--slots.free_count] : -1;
+}
+
+static inline void slot_put(int slot) {
+    slots.free_slots[slots.free_count++] = slot;
+}
+
+//give back a finished request, its write slot and the buffers behind its iovecs
+void req_free(struct request* req) {
+    for (int i = 0; i < req->iovec_count; i++) {
+        buf_free(req->iov[i].iov_base, req->iov[i].iov_len);
+    }
+    if (req->slot >= 0) {
+        slot_put(req->slot);
+    }
+    pool_put(&pool.reqs, req);
+}
+
+// find or add the child of node called name (len bytes)
+struct topic_tree* topic_child(struct topic_tree* node, const char* name, size_t len, int create) {
+    for (int i = 0; i < node->num_children; i++) {
+        if (strlen(node->child[i]->topic) == len && memcmp(node->child[i]->topic, name, len) == 0) {
+            return node->child[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (node->num_children == node->cap_children) {
+        int cap = node->cap_children ? node->cap_children * 2 : 4;
+        struct topic_tree** grown = realloc(node->child, cap * sizeof(*grown));
+        if (!grown) {
+            perror("realloc");
+            return NULL;
+        }
+        node->child = grown;
+        node->cap_children = cap;
+    }
+    struct topic_tree* child = calloc(1, sizeof(*child));
+    if (!child || !(child->topic = strndup(name, len))) {
+        perror("calloc");
+        free(child);
+        return NULL;
+    }
+    node->child[node->num_children++] = child;
+    return child;
+}
+
+// Walk a colon separated path (len bytes) from root, adding missing nodes
+// when create is set. With out_bits every bitmap on the way is ORed into it.
+// Returns the last node, NULL if the path is not in the tree
+struct topic_tree* topic_walk(struct topic_tree* root, const char* path, size_t len, int create, uint64_t* out_bits) {
+    struct topic_tree* node = root;
+    const char* end = path + len;
+    while (node && path < end) {
+        const char* sep = memchr(path, ':', end - path);
+        size_t seg = sep ? (size_t)(sep - path) : (size_t)(end - path);
+        node = seg ? topic_child(node, path, seg, create) : NULL;
+        if (node && out_bits) {
+            for (int w = 0; w < node->sub_words; w++) {
+                out_bits[w] |= node->subs[w];
+            }
+        }
+        path += seg + 1;
+    }
+    return node;
+}
+
+// set the bit of id in node, growing its bitmap to reach it. 0 if it was already set
+static int node_set(struct topic_tree* node, int id) {
+    int w = id / 64;
+    if (w >= node->sub_words) {
+        uint64_t* grown = realloc(node->subs, (w + 1) * sizeof(*grown));
+        if (!grown) {
+            perror("realloc");
+            return 0;
+        }
+        memset(grown + node->sub_words, 0, (w + 1 - node->sub_words) * sizeof(*grown));
+        node->subs = grown;
+        node->sub_words = w + 1;
+    }
+    if (node->subs[w] & (1ULL << (id % 64))) {
+        return 0;
+    }
+    node->subs[w] |= 1ULL << (id % 64);
+    return 1;
+}
+
+// take a subscriber id out of every node it subscribed to
+void subscriber_unsubscribe(int id) {
+    subscriber_t* sub = sub_at(id);
+    for (int i = 0; i < sub->node_count; i++) {
+        sub->nodes[i]->subs[id / 64] &= ~(1ULL << (id % 64));
+    }
+    sub->node_count = 0;
+}
 
+static void subscriber_add_node(int id, struct topic_tree* root, const char* path, size_t len) {
+    subscriber_t* sub = sub_at(id);
+    //only nodes the publisher has, a client can't grow the tree
+    struct topic_tree* node = len ? topic_walk(root, path, len, 0, NULL) : NULL;
+    if (!node || sub->node_count == MAX_SUB_NODES || !node_set(node, id)) {
+        return;
+    }
+    sub->nodes[sub->node_count++] = node;
+}
+
+/*
+Replace what subscriber id is subscribed to with text, one of
+    1. {toplevel} -> subscribe to everything under a certain toplevel
+    2. {toplevel:child1} -> subscribe only to child1 from toplevel
+    3. {toplevel:child1:grandchild1} -> subscribe only to grandchild1
+    4. {toplevel:child1,child2} -> subscribe to child1 and child2
+    5. {toplevel:child1,child2:grandchild3} -> subscribe to child1 and the 3rd child of child2
+a message for {toplevel:child2} then goes to entries 1 and 4.
+Paths that are not in the tree are left out, nothing is published there
+*/
+void subscriber_subscribe(int id, struct topic_tree* root, const char* text) {
+    subscriber_t* sub = sub_at(id);
+    subscriber_unsubscribe(id);
+    snprintf(sub->topic, sizeof(sub->topic), "%s", text);
+
+    char* s = sub->topic;
+    s[strcspn(s, "\r\n")] = '\0';
+    size_t len = strlen(s);
+    if (len >= 2 && s[0] == '{' && s[len - 1] == '}') {
+        s++;
+        len -= 2;
+    }
+    const char* alts = memchr(s, ':', len);
+    if (!alts) {
+        subscriber_add_node(id, root, s, len); //1.
+        return;
+    }
+    // head, then comma separated paths under it
+    char path[MAX_TOPIC_LEN];
+    size_t head = alts - s;
+    const char* end = s + len;
+    memcpy(path, s, head + 1);
+    for (const char* alt = alts + 1; alt < end; ) {
+        const char* comma = memchr(alt, ',', end - alt);
+        size_t alen = comma ? (size_t)(comma - alt) : (size_t)(end - alt);
+        if (head + 1 + alen < sizeof(path)) {
+            memcpy(path + head + 1, alt, alen);
+            subscriber_add_node(id, root, path, head + 1 + alen);
+        }
+        alt += alen + 1;
+    }
+}
+
+// Add a chunk of free ids. Returns -1 when max_subs is reached
+static int subscriber_grow(void) {
+    if (sub_slots >= max_subs) {
+        return -1;
+    }
+    subscriber_t* chunk = calloc(SUB_CHUNK, sizeof(subscriber_t));
+    if (!chunk) {
+        perror("subscriber chunk calloc");
+        return -1;
+    }
+    for (int i = 0; i < SUB_CHUNK; i++) {
+        chunk[i].tcp_sock = -1;
+    }
+    sub_chunks[sub_slots / SUB_CHUNK] = chunk;
+    sub_slots += SUB_CHUNK;
+    return 0;
+}
+
+// give an accepted socket a subscriber id, -1 when all are taken
+int subscriber_add(int fd) {
+    for (int id = 0; ; id++) {
+        if (id == sub_slots && subscriber_grow() < 0) {
+            return -1;
+        }
+        subscriber_t* sub = sub_at(id);
+        if (sub->tcp_sock < 0) {
+            sub->tcp_sock = fd;
+            sub->topic[0] = '\0';
+            sub->node_count = 0;
+            return id;
+        }
+    }
+}
+
+// Set up the ring for mode and register a sparse file table for the sockets.
+// Falls back to a plain ring when the kernel does not take the flags
+int ring_setup(int mode) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (mode == RING_SQPOLL) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    } else if (mode == RING_DEFER) {
+        //only this thread submits, so task work can wait for io_uring_enter
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
+    int ret = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+    if (ret < 0 && params.flags) {
+        printf("[PUB] Ring flags not supported (%s), using a plain ring\n", strerror(-ret));
+        memset(&params, 0, sizeof(params));
+        ret = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+    fixed_files = io_uring_register_files_sparse(&ring, FIXED_FILES) == 0;
+    return 0;
+}
+
+// put fd in the file table at index fd (-1 to take it out). An fd that
+// does not fit or fails to register is not an error, its SQEs just use
+// the plain fd. Returns 1 if fd is in the table
+int register_file(int fd, int file) {
+    if (!fixed_files || fd < 0 || fd >= FIXED_FILES) {
+        return 0;
+    }
+    if (file < 0) {
+        if (fixed_fd[fd]) {
+            io_uring_register_files_update(&ring, fd, &file, 1);
+            fixed_fd[fd] = 0;
+        }
+        return 0;
+    }
+    fixed_fd[fd] = io_uring_register_files_update(&ring, fd, &file, 1) == 1;
+    return fixed_fd[fd];
+}
+
+void subscriber_remove(int id) {
+    subscriber_t* sub = sub_at(id);
+    subscriber_unsubscribe(id);
+    register_file(sub->tcp_sock, -1);
+    close(sub->tcp_sock);
+    sub->tcp_sock = -1;
+}
+
+// Next free SQE. Requests are only queued, the loop submits them all once
+// per iteration; a full SQ ring is pushed out early
+struct io_uring_sqe* get_sqe(void) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (!sqe && io_uring_submit(&ring) >= 0) {
+        sqe = io_uring_get_sqe(&ring);
+    }
+    if (!sqe) {
+        errno = EBUSY;
+    }
+    return sqe;
+}
+
+static inline void sqe_file(struct io_uring_sqe* sqe, int fd) {
+    if (fixed_files && fd < FIXED_FILES && fixed_fd[fd]) {
+        sqe->flags |= IOSQE_FIXED_FILE; //fd is the file table index
+    }
+}
+
+// The request is allocated before the SQE is taken: a taken SQE goes out
+// with the next submit whether it was prepared or not
 int add_accept_request(int server_socket, struct sockaddr_in* client_addr, socklen_t* client_addr_len) {
+    struct request* req = req_alloc();
+    if (!req) {
+        errno = ENOMEM;
+        return -1;
+    }
     //sqe = submission queue entry
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        req_free(req);
+        return -1;
+    }
     io_uring_prep_accept(sqe, server_socket, (struct sockaddr*) client_addr, client_addr_len, 0);
-    //prepare and submit accept request
-    struct request* req = malloc(sizeof(struct request));
+    sqe_file(sqe, server_socket);
+    //prepare and queue accept request
     req->event_type = EVENT_TYPE_ACCEPT;
     io_uring_sqe_set_data(sqe, req);
-    return io_uring_submit(&ring);
+    return 0;
 }
 
-int add_read_request(int client_socket) {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
-    struct request* req = malloc(sizeof(struct request) + sizeof(struct iovec));
-    req->iov[0].iov_base = calloc(READ_SZ,1);
-    req->iov[0].iov_len = READ_SZ;
+int add_read_request(int client_socket, int sub_id) {
+    struct request* req = req_alloc();
+    if (!req) {
+        errno = ENOMEM;
+        return -1;
+    }
+    req->iov[0].iov_base = buf_alloc(READ_SZ);
+    if (!req->iov[0].iov_base) {
+        req_free(req);
+        errno = ENOMEM;
+        return -1;
+    }
+    req->iov[0].iov_len = READ_SZ - 1; //room for a NUL after what was read
+    req->iovec_count = 1;
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        req_free(req);
+        return -1;
+    }
     req->client_socket = client_socket;
-    //prepare and submit read request
+    req->sub_id = sub_id;
+    //prepare and queue read request
     req->event_type = EVENT_TYPE_READ;
     io_uring_prep_readv(sqe, client_socket, &req->iov[0], 1, 0);    //eventually calls read
+    sqe_file(sqe, client_socket);
     io_uring_sqe_set_data(sqe, req);
-    return io_uring_submit(&ring);
+    return 0;
 }
 
 int add_write_request(struct request* req) {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
-    //prepare and submit write request
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        return -1;
+    }
     req->event_type = EVENT_TYPE_WRITE;
-    io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
+    if (req->slot < 0) {
+        io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
+    } else if (slots.fixed) {
+        io_uring_prep_write_fixed(sqe, req->client_socket, req->iov[0].iov_base, req->iov[0].iov_len, 0, 0);
+    } else {
+        io_uring_prep_write(sqe, req->client_socket, req->iov[0].iov_base, req->iov[0].iov_len, 0);
+    }
+    sqe_file(sqe, req->client_socket);
     io_uring_sqe_set_data(sqe, req);
-    return io_uring_submit(&ring);
+    return 0;
 }
 
-//generate (random topic) headers and body for a request
+//generate (random topic) headers and body for a request:
+//a random path down the tree, e.g. {toplevel:child2}
 void generate_request_data(char** headers, char** body, struct topic_tree* topics){
-    char* new_headers = calloc(MAX_TOPIC_LEN,1);
-    int num = (rand() % 5) + 1;
-    // for(int i = 0; i < 30; i++){
-    //     num = rand() % 30;
-    //     printf("num %d: %d\n",i,num);
-    // }
-    //copy starting topic into headers
+    char* new_headers = buf_alloc(MAX_TOPIC_LEN);
+    size_t len = 0;
+    struct topic_tree* node = topics;
     strcpy(new_headers,"{");
-    strcat(new_headers,topics->topic);
-    
-    if(num == 1){
-        strcat(new_headers,":child1,child2:grand4");
-    }
-    if(num == 2){
-        strcat(new_headers,":child2");
-    }
-    if(num == 3){
-        strcat(new_headers,":child1:grand2");
-    }
-    if(num == 4){
-        strcat(new_headers,":child2,child3:grand5");
-    }
-    //programatically generate random topic strings
-    //may fix later since it's buggy now
-    // 4/5 chance of including children
-    // if(num < 4){
-    //     strcat(new_headers,":");
-    //     for(int i = 0; i < topics->num_children; i++){
-    //         struct topic_tree* current = topics->child[i];
-    //         for(int j = 0; j < current->num_children; j++){
-    //             num = (rand() % 5) + 1;
-    //             if(num < 6){
-
-    //             }
-    //         }
-    //         if(current && current->topic){
-    //             strcat(new_headers,current->topic);
-    //             num = (rand() % 5) + 1;
-    //         }
-
-    //     }
-    // }
-
-
+    len = 1;
+    // 2/3 chance of going one level further down
+    while (node->num_children > 0 && (node == topics || rand() % 3 != 0)) {
+        node = node->child[rand() % node->num_children];
+        size_t tlen = strlen(node->topic);
+        if (len + tlen + 3 > MAX_TOPIC_LEN) {
+            break;
+        }
+        if (len > 1) {
+            new_headers[len++] = ':';
+        }
+        memcpy(new_headers + len, node->topic, tlen);
+        len += tlen;
+    }
     //closing curly brace
-    strcat(new_headers,"}");
+    new_headers[len++] = '}';
+    new_headers[len] = '\0';
     if(headers != NULL){
-        memcpy(*headers,new_headers,strlen(new_headers));
-    }
-}
-
-void build_headers(struct iovec* iov, char* topic){
-    char send_buffer[1024];
-
-    //0: http 200 ok
-    char* http_ok = "HTTP/1.0 200 OK\r\n";
-    unsigned long slen = strlen(http_ok);
-    iov[0].iov_base = calloc(slen,1);
-    iov[0].iov_len = slen;
-    memcpy(iov[0].iov_base, http_ok, slen);
-
-    //1: Content type
-    char* content_type = "Content-Type: text/html\r\n";
-    slen = strlen(content_type);
-    iov[1].iov_base = calloc(slen,1);
-    iov[1].iov_len = slen;
-    memcpy(iov[1].iov_base, content_type, slen);
-
-    //2: Content length
-    unsigned long tlen = strlen(topic);
-    sprintf(send_buffer, "Content-Length: %ld\r\n",tlen);
-    slen = strlen(send_buffer);
-    iov[2].iov_base = calloc(slen,1);
-    iov[2].iov_len = slen;
-    memcpy(iov[2].iov_base, send_buffer, slen);
-
-    //3: topic headers
-    iov[3].iov_base = calloc(tlen,1);
-    iov[3].iov_len = tlen;
-    memcpy(iov[3].iov_base, topic, tlen);
-
-    //4: line ending
-    char* ending = "\r\n";
-    slen = strlen(ending);
-    iov[4].iov_base = calloc(slen,1);
-    iov[4].iov_len = slen;
-    memcpy(iov[4].iov_base, ending, slen);
-}
-
-//
-void parse_response(){
-    /*
-    Idea:
-    - the publisher would publish new messages at random, each under various topics
-    - When publisher starts, it has a "clean slate"
-    - subscribers need to register with the publisher by sending a request
-        formatted a certain way (e.g. topics to subscribe to)
-    - each new registered subscriber gets an id (file descriptor?)
-    - add_write_request would only submit entries to the queue for the applicable subscription requests
-        (req->client_socket) client_socket would be the applicable subscriber
-    - add_write_request would also take a message topic string
-        it uses this to determine which subscribers to send the message to
-        When a message needs to be sent:
-            go through the list of known subscribers and their topic strings
-            select only those subscribers whose topic string satisfies a match with the new message
-            call io_uring_prep_writev and io_uring_sqe_set_data in a for loop for all the matching subscribers
-    - ideally, a mapping would be stored. 
-        Create a 2D array. Map a topic string to an array of subscriber ids/fds
-
-    -topic format (header):
-
-    1. {toplevel} -> subscribe to everything under a certain toplevel
-    2. {toplevel:child1} -> subscribe only to child1 from toplevel
-    3. {toplevel:child1:grandchild1} -> subscribe only to grandchild1
-    4. {toplevel:child1,child2} -> subscribe to child1 and child2
-    5. {toplevel:child1,child2:grandchild3} -> subscribe to child1 and the 3rd child of child2
-    (This is what the subscriber sends to update its subscription)
-
-    (new message to be sent):
-    {toplevel:child2}
-
-    entries 1 and 4 get this message
-    check for "{toplevel}" and ( "child2}" or "child2," )
+        memcpy(*headers,new_headers,len + 1);
+    }
+    buf_free(new_headers, MAX_TOPIC_LEN);
+}
 
-    This might require that every topic and subtopic name be unique
+// Fill the variable part of a write slot for topic and point iov at the
+// whole response. Returns its length, -1 if topic does not fit the slot
+int build_headers(struct iovec* iov, int slot, const char* topic){
+    char* buf = slots.arena + (size_t)slot * WRITE_SLOT_SZ;
+    size_t prefix = strlen(HEADER_PREFIX);
+    size_t tlen = strlen(topic);
+
+    //constant lines are already there, add content length, topic headers and line ending
+    int n = snprintf(buf + prefix, WRITE_SLOT_SZ - prefix, "Content-Length: %zu\r\n%s\r\n", tlen, topic);
+    if (n < 0 || (size_t)n >= WRITE_SLOT_SZ - prefix) {
+        return -1;
+    }
+    iov->iov_base = buf;
+    iov->iov_len = prefix + n;
+    return (int)iov->iov_len;
+}
 
-    */
+// Send a message for topic ({toplevel:child2}) to everyone subscribed to a
+// node on its path. The recipients are resolved with a bitmap OR per level,
+// then each gets its own write SQE, they go out with the loop's next submit.
+// Returns the number of recipients, -1 if the ring failed
+int publish_topic(struct topic_tree* root, const char* topic) {
+    int words = sub_slots / 64;
+    memset(recipients, 0, words * sizeof(*recipients));
+    size_t len = strlen(topic);
+    const char* path = topic;
+    if (len >= 2 && path[0] == '{' && path[len - 1] == '}') {
+        path++;
+        len -= 2;
+    }
+    topic_walk(root, path, len, 0, recipients);
+
+    int sent = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = recipients[w];
+        while (bits) {
+            int id = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            int slot = slot_get();
+            if (slot < 0) {
+                //every slot is still being written, skip this one
+                slots.dropped++;
+                continue;
+            }
+            struct request* write_req = req_alloc();
+            if (!write_req) {
+                slot_put(slot);
+                errno = ENOMEM;
+                return -1;
+            }
+            write_req->client_socket = sub_at(id)->tcp_sock;
+            write_req->sub_id = id;
+            write_req->slot = slot;
+            if (build_headers(write_req->iov, slot, topic) < 0) {
+                req_free(write_req);
+                continue;
+            }
+            if (add_write_request(write_req) < 0) {
+                req_free(write_req);
+                return -1;
+            }
+            sent++;
+        }
+    }
+    return sent;
 }
 
+// the tree a publisher starts with, returns the number of nodes
 int build_topic_tree(struct topic_tree** tree){
+    static const char* paths[] = {
+        "toplevel:child1:grand1",
+        "toplevel:child1:grand2",
+        "toplevel:child1:grand3",
+        "toplevel:child2:grand4",
+        "toplevel:child3:grand5",
+        "toplevel:child3:grand6",
+    };
     int num_children = 0;
+    //the root has no name, the top level topics are its children
     *tree = calloc(sizeof(struct topic_tree),1);
-    (*tree)->topic = "toplevel";
-    (*tree)->num_children = 3;
-    (*tree)->child[0] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[0]->topic = "child1";
-    (*tree)->child[0]->num_children = 3;
-    (*tree)->child[0]->child[0] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[0]->child[1] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[0]->child[2] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[0]->child[0]->topic = "grand1";
-    (*tree)->child[0]->child[1]->topic = "grand2";
-    (*tree)->child[0]->child[2]->topic = "grand3";
-
-    (*tree)->child[1] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[1]->topic = "child2";
-    (*tree)->child[0]->num_children = 1;
-    (*tree)->child[1]->child[0] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[1]->child[0]->topic = "grand4";
-    // (*tree)->child[1]->child[0]->num_children = 0;
-
-    (*tree)->child[2] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[2]->topic = "child3";
-    (*tree)->child[2]->num_children = 2;
-    (*tree)->child[2]->child[0] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[2]->child[1] = malloc(sizeof(struct topic_tree));
-    (*tree)->child[2]->child[0]->topic = "grand5";
-    (*tree)->child[2]->child[1]->topic = "grand6";
-
-    num_children = 10;
+    if (!*tree || !((*tree)->topic = strdup(""))) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (!topic_walk(*tree, paths[i], strlen(paths[i]), 1, NULL)) {
+            fprintf(stderr, "failed to add topic %s\n", paths[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    //count what got built
+    struct topic_tree* stack[64];
+    int top = 0;
+    stack[top++] = *tree;
+    while (top > 0) {
+        struct topic_tree* node = stack[--top];
+        num_children += node->num_children;
+        for (int i = 0; i < node->num_children && top < 64; i++) {
+            stack[top++] = node->child[i];
+        }
+    }
     return num_children;
 }
 
-int main(int argc, char* argv){
+int main(int argc, char** argv){
+    int ring_mode = RING_DEFAULT;
+    int c;
+    while ((c = getopt(argc, argv, "m:n:")) != -1) {
+        if (c == 'm' && strcmp(optarg, "sqpoll") == 0) {
+            ring_mode = RING_SQPOLL;
+        } else if (c == 'm' && strcmp(optarg, "defer") == 0) {
+            ring_mode = RING_DEFER;
+        } else if (c == 'n' && atoi(optarg) > 0) {
+            max_subs = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-m sqpoll|defer] [-n max_subscribers]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     struct topic_tree* topics;
     int num_children = 0;
     num_children = build_topic_tree(&topics);
-    topics->num_children = num_children;
+    printf("[PUB] Topic tree with %d topics\n", num_children);
 
     int server_fd;    
     struct sockaddr_in address = {
@@ -306,10 +744,13 @@ int main(int argc, char* argv){
         exit(EXIT_FAILURE);
     }
 
-    // Initialize subscribers list
-    subscriber_t subs[MAX_SUBS];
-    for (int i = 0; i < MAX_SUBS; i++) {
-        subs[i].tcp_sock = -1;
+    // subscriber ids come in chunks as they are needed
+    max_subs = (max_subs + SUB_CHUNK - 1) / SUB_CHUNK * SUB_CHUNK;
+    sub_chunks = calloc(max_subs / SUB_CHUNK, sizeof(*sub_chunks));
+    recipients = calloc(max_subs / 64, sizeof(*recipients));
+    if (!sub_chunks || !recipients) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
     }
 
     // Allocate and set up subscription listener
@@ -319,12 +760,14 @@ int main(int argc, char* argv){
         return 1;
     }
     subset->socket = server_fd;
-    subset->subs = subs;
     signal(SIGINT,sigint_handler);
 
     //io_uring setup
-    struct io_uring_cqe* cqe;
-    io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+    struct io_uring_cqe* cqes[CQE_BATCH];
+    if (ring_setup(ring_mode) < 0 || write_slots_init() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    register_file(server_fd, server_fd);
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
@@ -336,112 +779,122 @@ int main(int argc, char* argv){
 
     printf("[PUB] Listening on port %d...\n",PORT);
 
-    //Array mapping subscriber fds to topics
-    char subscriber_topics[MAX_SUBS + 5][MAX_TOPIC_LEN] = {0};
-
     //for generating random topics
     srand(time(NULL));
 
     int ret = 0;
     while(running){
-        /*
-        Todo:
-        configure headers correctly (as in send_headers())
-        */
-        //wait for completion queue entries
-        ret = io_uring_wait_cqe(&ring, &cqe);
-        if (ret < 0) {
-            perror("io_uring_wait_cqe");
+        //push out everything queued since the last pass and wait for completions.
+        //With SQPOLL the kernel thread picks SQEs up and this only waits
+        ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
             exit(EXIT_FAILURE);
         }
-        struct request* req = (struct request*) cqe->user_data;
-        if (cqe->res < 0) { //return value for this event
-            continue;
-        }
-        // struct request* write_req = malloc(sizeof(struct request) + sizeof(struct iovec));
-        // unsigned long slen = strlen("RESPONSE");
-        // write_req->iovec_count = 1;
-        // write_req->client_socket = req->client_socket;
-        // write_req->iov[0].iov_base = malloc(slen);
-        // write_req->iov[0].iov_len = slen;
-        // memcpy(write_req->iov[0].iov_base, "RESPONSE", slen);
-        // add_write_request(write_req);
-
-        switch (req->event_type) {
-            case EVENT_TYPE_ACCEPT:
-                if(add_accept_request(server_fd, &client_addr, &client_addr_len) < 0){
-                    fprintf(stderr, "add_accept_request failed: %s\n",strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                //we've accepted the request, so now we need to read it
-                if(add_read_request(cqe->res) < 0){
-                    fprintf(stderr, "add_read_request failed: %s\n",strerror(errno));
-                    exit(EXIT_FAILURE);
+        unsigned count = io_uring_peek_batch_cqe(&ring, cqes, CQE_BATCH);
+        for (unsigned n = 0; n < count; n++) {
+            struct io_uring_cqe* cqe = cqes[n];
+            struct request* req = (struct request*) cqe->user_data;
+            if (cqe->res < 0) { //return value for this event
+                if (req->event_type == EVENT_TYPE_ACCEPT) {
+                    add_accept_request(server_fd, &client_addr, &client_addr_len);
+                } else if (req->event_type == EVENT_TYPE_READ) {
+                    printf("Read failed on socket %d: %s\n", req->client_socket, strerror(-cqe->res));
+                    subscriber_remove(req->sub_id);
                 }
-                //Once we handle the action for a request, we don't need it anymore, so we free it
-                free(req);
-                break;
-            case EVENT_TYPE_READ:
-                // io_uring_peek_cqe(&ring,&cqe);
-                printf("Request received (socket %d):\n%s\n",req->client_socket,(char*)req->iov[0].iov_base);
-                memcpy(subscriber_topics[req->client_socket],(char*)req->iov[0].iov_base,MAX_TOPIC_LEN);
-                // printf("subscriber_topics[%d]: %s\n",req->client_socket,subscriber_topics[req->client_socket]);
-                //if the client closed the connection, we don't want to add a new write request,
-                //since we can't use that socket/fd (it was just closed).
-                if (cqe->res == 0) {    //read returns 0 (end of file)
-                    printf("Client disconnected. Closing socket %d\n", req->client_socket);
-                    close(req->client_socket);
-                    free(req->iov[0].iov_base);
-                    free(req);
+                //a failed write leaves the socket to its pending read
+                req_free(req);
+                continue;
+            }
+            // struct request* write_req = malloc(sizeof(struct request) + sizeof(struct iovec));
+            // unsigned long slen = strlen("RESPONSE");
+            // write_req->iovec_count = 1;
+            // write_req->client_socket = req->client_socket;
+            // write_req->iov[0].iov_base = malloc(slen);
+            // write_req->iov[0].iov_len = slen;
+            // memcpy(write_req->iov[0].iov_base, "RESPONSE", slen);
+            // add_write_request(write_req);
+
+            switch (req->event_type) {
+                case EVENT_TYPE_ACCEPT: {
+                    if(add_accept_request(server_fd, &client_addr, &client_addr_len) < 0){
+                        fprintf(stderr, "add_accept_request failed: %s\n",strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    //we've accepted the request, so give it an id and read its subscription
+                    int sub_id = subscriber_add(cqe->res);
+                    if (sub_id < 0) {
+                        printf("No free subscriber ids, closing socket %d\n", cqe->res);
+                        close(cqe->res);
+                        req_free(req);
+                        break;
+                    }
+                    //past the file table it is read and written by plain fd
+                    register_file(cqe->res, cqe->res);
+                    if(add_read_request(cqe->res, sub_id) < 0){
+                        fprintf(stderr, "add_read_request failed: %s\n",strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    //Once we handle the action for a request, we don't need it anymore, so we free it
+                    req_free(req);
                     break;
                 }
-                //create new (write) request to add to queue
-                //we've received the request, now we're sending the response
-                struct request* write_req = malloc(sizeof(struct request) + sizeof(struct iovec) * 5);
-                char* headers = calloc(MAX_TOPIC_LEN,1);
-                generate_request_data(&headers,NULL,topics);
-                write_req->iovec_count = 5;
-                write_req->client_socket = req->client_socket;
-                build_headers(write_req->iov,headers);
-                // memcpy(write_req->iov[0].iov_base, RESPONSE, slen);
-                //once we've read the request, we can add a new write request to the queue
-                if(add_write_request(write_req) < 0){
-                    fprintf(stderr, "add_write_request failed: %s\n",strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                // puts("Added request");
-                free(req->iov[0].iov_base);
-                free(headers);
-                free(req);
-                break;
-            case EVENT_TYPE_WRITE:
-                puts("Sending response:");
-                for(int i = 0; i < req->iovec_count; i++){
-                    printf("%s",(char*)req->iov[i].iov_base);
-                }
-                //add_write_request(req);
-                if(add_read_request(req->client_socket) < 0){
-                    fprintf(stderr, "add_read_request failed: %s\n",strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                for (int i = 0; i < req->iovec_count; i++) {
-                    free(req->iov[i].iov_base);
+                case EVENT_TYPE_READ: {
+                    //if the client closed the connection, drop its id and bits,
+                    //since we can't use that socket/fd anymore
+                    if (cqe->res == 0) {    //read returns 0 (end of file)
+                        printf("Client disconnected. Closing socket %d\n", req->client_socket);
+                        subscriber_remove(req->sub_id);
+                        req_free(req);
+                        break;
+                    }
+                    ((char*)req->iov[0].iov_base)[cqe->res] = '\0';
+                    printf("Request received (socket %d):\n%s\n",req->client_socket,(char*)req->iov[0].iov_base);
+                    subscriber_subscribe(req->sub_id, topics, (char*)req->iov[0].iov_base);
+                    printf("subs[%d]: %s (%d topics)\n",req->sub_id,sub_at(req->sub_id)->topic,sub_at(req->sub_id)->node_count);
+                    //keep reading, the subscriber can change its subscription any time
+                    if(add_read_request(req->client_socket, req->sub_id) < 0){
+                        fprintf(stderr, "add_read_request failed: %s\n",strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    req_free(req);
+
+                    //publish a message under a random topic to whoever matches it
+                    char* headers = buf_alloc(MAX_TOPIC_LEN);
+                    generate_request_data(&headers,NULL,topics);
+                    int sent = publish_topic(topics, headers);
+                    if (sent < 0) {
+                        fprintf(stderr, "publish failed: %s\n",strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    printf("Published %s to %d subscribers (%lu skipped without a write slot)\n", headers, sent, slots.dropped);
+                    buf_free(headers, MAX_TOPIC_LEN);
+                    break;
                 }
-                free(req);
-                break;
-            default:
-                puts("Other event case");
-                break;
-        }
-
-        for(int i = 0; i < MAX_SUBS + 5; i++){
-            if(strcmp(subscriber_topics[i],"") != 0){
-                printf("subscriber_topics[%d]:\n%s\n",i,subscriber_topics[i]);
+                case EVENT_TYPE_WRITE:
+                    if (req->slot >= 0 && (size_t)cqe->res < req->iov[0].iov_len) {
+                        //short write, send the rest of the slot
+                        req->iov[0].iov_base = (char*)req->iov[0].iov_base + cqe->res;
+                        req->iov[0].iov_len -= cqe->res;
+                        if (add_write_request(req) < 0) {
+                            fprintf(stderr, "add_write_request failed: %s\n",strerror(errno));
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+                    }
+                    printf("Sending response (subscriber %d):\n", req->sub_id);
+                    printf("%.*s",(int)req->iov[0].iov_len,(char*)req->iov[0].iov_base);
+                    req_free(req);
+                    break;
+                default:
+                    puts("Other event case");
+                    break;
             }
+
         }
-       
-        //Mark this request as processed
-        io_uring_cqe_seen(&ring, cqe);
+
+        //Mark this batch as processed
+        io_uring_cq_advance(&ring, count);
     }
 
     free(subset);
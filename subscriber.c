@@ -1,164 +1,24 @@
 // subscriber.c
 // subscribe to all publishers, broadcast topic on request
-// receives with io_uring
+// command line front end of the mqsub library (mqsub.c)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <errno.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <sys/select.h>
-#include <arpa/inet.h>
 #include <pthread.h>
-#include <liburing.h>
-#include <stdatomic.h>
+#include <getopt.h>
+#include "mqsub.h"
 
 #define BUFFER_SIZE 1024
-#define QUEUE_DEPTH 512
-#define MAX_TOPIC_LEN 64
-#define TOPIC_CAPACITY 16
-#define DEFAULT_PORT 5555
-#define MICROSERVICE_PORT 4444
-#define HEARTBEAT_PORT 5554
-#define HEARTBEAT_INTERVAL 1
-#define BROADCAST_IP "127.255.255.255"
-#define SYSTEM_ID 99
 
-#define TYPE_ACCEPT  0
-#define TYPE_READ  1
-
-typedef struct __attribute__((packed)) {
-    uint32_t system_id;
-    uint16_t advertised_port;
-    uint16_t topic_count;
-    char topics[TOPIC_CAPACITY][MAX_TOPIC_LEN];
-    uint64_t timestamp; // Time when the heartbeat was sent
-} heartbeat_t;
-
-typedef struct request{
-    int type;
-    int client_fd;
-    int iov_count;
-    struct iovec iov[];
-} request;
-
-struct io_uring ring;
-static char **subscribed_topics = NULL;
-static uint16_t topic_count = 0;
-static uint32_t subscriber_id; //to be put in every heartbeat system_id
-static uint16_t listen_port; //find available port
-static _Atomic uint64_t sub_read  = 0;
-static _Atomic uint64_t sub_read_err  = 0;
-static _Atomic uint64_t sub_closed    = 0;
-
-
-// check whether already subscribed
-static int is_subscribed(const char *topic) {
-    for (int i = 0; i < topic_count; ++i) {
-        if (strcmp(subscribed_topics[i], topic) == 0)
-            return 1;
-    }
-    return 0;
-}
-
-int subscribe_to_topic(const char *topic){
-    if (!topic){
-        return -1;
-    } 
-    if (is_subscribed(topic)){
-        return 0;
-    }
-
-    if (topic_count >= TOPIC_CAPACITY) {
-        printf("[SUB] Topics at capacity\n");
-    }
-    else{
-        printf("[SUB] Added subscription for %s\n", topic);
-        subscribed_topics[topic_count++] = strdup(topic);
-    }
-
-    return 0;
-}
-
-int unsubscribe_from_topic(const char *topic) {
-    for (int i = 0; i < topic_count; ++i) {
-        if (strcmp(subscribed_topics[i], topic) == 0) {
-            free(subscribed_topics[i]);
-            //close the gap
-            for (int j = i; j < topic_count - 1; ++j)
-                subscribed_topics[j] = subscribed_topics[j + 1];
-            subscribed_topics[--topic_count] = NULL;
-            return 1;
-        }
-    }
-    return 0;
-}
-
-uint32_t generate_id() {
-    uint32_t pid_part = (uint32_t)getpid();
-    uint32_t time_part = (uint32_t)time(NULL);
-    return (pid_part * 31) ^ (time_part);
-}
-
-
-// Create UDP socket
-int setup_heartbeat(){
-    int hb_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (hb_sock < 0) {
-        perror("socket");
-        exit(1);
-    }
-         // Enable broadcast option
-    int broadcast_enable = 1;
-    if (setsockopt(hb_sock, SOL_SOCKET, SO_BROADCAST, &broadcast_enable, sizeof(broadcast_enable)) == -1) {
-        perror("setsockopt - SO_BROADCAST");
-        close(hb_sock);
-        exit(1);
-    }
-
-    return hb_sock;
-}
-
-//broadcast heartbeat
-void *heartbeat_thread(void *arg){
-    int hb_sock = *(int *)arg;
-    struct sockaddr_in broadcast_addr;
-    // Configure broadcast address
-    memset(&broadcast_addr, 0, sizeof(broadcast_addr));
-    broadcast_addr.sin_family = AF_INET;
-    broadcast_addr.sin_port = htons(HEARTBEAT_PORT);
-
-    if (inet_pton(AF_INET, BROADCAST_IP, &broadcast_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(hb_sock);
-        exit(EXIT_FAILURE);
-    }
-    printf("[SUB] Heartbeat thread started. Broadcasting heartbeat to %s:%d...\n",
-           BROADCAST_IP, HEARTBEAT_PORT);
-    
-    while (1) {
-        heartbeat_t hb;
-        hb.system_id = htonl(subscriber_id);
-        hb.timestamp = htobe64(time(NULL));
-        hb.advertised_port = htons(listen_port);
-        hb.topic_count = htons(topic_count);
-        // copy each topic string in
-        for (int i = 0; i < topic_count; ++i) {
-            strncpy(hb.topics[i], subscribed_topics[i], MAX_TOPIC_LEN-1);
-            hb.topics[i][MAX_TOPIC_LEN-1] = '\0';
-        }
-
-        int beat = sendto(hb_sock, &hb, sizeof(hb), 0, (struct sockaddr *)&broadcast_addr, sizeof(broadcast_addr));
-        if (beat < 0) {
-            perror("Failed to beat.");
-        }
-        else{
-            //printf("[SUB] beat.\n");////
-        }
-        sleep(HEARTBEAT_INTERVAL);
-    }
+static const char *bp_names[BP_COUNT] = { "drop-newest", "drop-oldest", "block", "disconnect" };
 
+// messages are only counted (mqsub_stats), the buffer goes straight back
+static void on_batch(void *ctx, mqsub_batch_t *batch, const mqsub_msg_t *msgs, size_t count) {
+    (void)ctx;
+    (void)msgs;
+    (void)count;
+    mqsub_release(batch);
 }
 
 void *input_thread(void *arg) {
@@ -167,7 +27,9 @@ void *input_thread(void *arg) {
     while (1) {
         memset(input, 0, sizeof(input));
 
-        fgets(input, sizeof(input), stdin);
+        if (!fgets(input, sizeof(input), stdin)) {
+            return NULL; //no terminal, keep receiving
+        }
 
         char *cmd = strtok(input, " \n");
         char *msg = strtok(NULL, " \n");
@@ -177,166 +39,100 @@ void *input_thread(void *arg) {
         }
 
         if(strcmp(cmd,"stat") == 0){
-            uint64_t reads    = atomic_load(&sub_read);
-            uint64_t errors   = atomic_load(&sub_read_err);
-            uint64_t closed   = atomic_load(&sub_closed);
-            printf("[SUB][STAT] reads=%lu, errors=%lu, closed=%lu\n",
-                   (unsigned long)reads,
-                   (unsigned long)errors,
-                   (unsigned long)closed);
+            mqsub_stats_t st;
+            mqsub_stats(&st);
+            printf("[SUB][STAT] reads=%lu, msgs=%lu, errors=%lu, closed=%lu, gaps=%lu, lost=%lu\n",
+                   (unsigned long)st.reads,
+                   (unsigned long)st.msgs,
+                   (unsigned long)st.errors,
+                   (unsigned long)st.closed,
+                   (unsigned long)st.gaps,
+                   (unsigned long)st.lost);
         }
         else if (strcmp(cmd,"add") == 0){
             if (!msg) {
                 printf("Usage: add <topic>\n");
             } else {
-                subscribe_to_topic(msg);
+                mqsub_subscribe(msg);
             }
         }
         else if (strcmp(cmd,"remove") == 0){
             if (!msg) {
                 printf("Usage: remove <topic>\n");
             } else {
-                unsubscribe_from_topic(msg);
+                mqsub_unsubscribe(msg);
                 printf("[SUB] Removed subscription for '%s'\n", msg);
-            } 
+            }
         }
 
     }
 }
 
-int add_accept_request(int server_socket, struct sockaddr_in *client_addr, socklen_t *client_addr_len) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_accept(sqe, server_socket, (struct sockaddr *) client_addr, client_addr_len, 0);
-    struct request *req = malloc(sizeof(*req));
-    req->type = TYPE_ACCEPT;
-    io_uring_sqe_set_data(sqe, req);
-    io_uring_submit(&ring);
-    return 0;
-}
-
-int add_read_request(int client_socket) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    struct request *req = malloc(sizeof(*req) + sizeof(struct iovec));
-    req->iov[0].iov_base = malloc(BUFFER_SIZE);
-    req->iov[0].iov_len = BUFFER_SIZE;
-    req->type = TYPE_READ;
-    req->client_fd = client_socket;
-    memset(req->iov[0].iov_base, 0, BUFFER_SIZE);
-    io_uring_prep_readv(sqe, client_socket, &req->iov[0], 1, 0);
-    io_uring_sqe_set_data(sqe, req);
-    io_uring_submit(&ring);
-    return 0;
-}
-
-int setup_listen_socket(uint16_t *out_port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    int yes = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &yes, sizeof(yes));
-
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_port = htons(0) //ask for a free port
+int main(int argc, char *argv[]) {
+    mqsub_config_t config = {
+        .policy = BP_DROP_NEWEST,
+        .recv_threads = 1,
+        .on_batch = on_batch,
     };
-    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
-
-    socklen_t len = sizeof(addr);
-    if (getsockname(sock, (struct sockaddr*)&addr, &len) < 0) {
-        perror("[SUB] getsockname fail");
-        close(sock);
-        return -1;
-    }
-    *out_port = ntohs(addr.sin_port);
-
-    listen(sock, SOMAXCONN);
-    printf("[SUB] Listening on port %u\n", *out_port);
-    return sock;
-}
-
-
-void receive_loop(int sock, const char *sub_topic) {
-    
-    char buffer[BUFFER_SIZE + 1] = {0};
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    //prime io_uring for first accept
-    add_accept_request(sock, &address, &addrlen);
-
-    while (1) {
-
-        struct io_uring_cqe *cqe;
-        io_uring_wait_cqe(&ring, &cqe);
-        if(!cqe) {
-            continue;
-            // exit(EXIT_FAILURE);
-        }
-        struct request *req = (struct request *) cqe->user_data;
-
-        switch (req->type) {
-            case TYPE_ACCEPT:
-                printf("[SUB] Accepted client FD: %d\n", cqe->res);
-                add_accept_request(sock, &address, &addrlen);
-            	add_read_request(cqe->res);
-		        break;
-            case TYPE_READ:
-                int result = cqe->res;
-		        
-                if (result > 0) {
-                    atomic_fetch_add(&sub_read, 1);
-                    char *msg = req->iov[0].iov_base;
-                    msg[result] = '\0';
-                    // printf("Read from FD: %d: %s\n", req->client_fd, msg);
-                    free(msg);
-                    add_read_request(req->client_fd);
-                    //handle_client_request(req);
-                } else if(result == 0){
-                    atomic_fetch_add(&sub_closed, 1);
-                }else {
-                    atomic_fetch_add(&sub_read_err, 1);
-                    close(req->client_fd);
+    int opt;
+    while ((opt = getopt(argc, argv, "r:m:b:sg")) != -1) {
+        switch (opt) {
+            case 'r':
+                config.recv_threads = atoi(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "sqpoll") == 0) {
+                    config.ring_mode = MQSUB_RING_SQPOLL;
+                } else if (strcmp(optarg, "defer") == 0) {
+                    config.ring_mode = MQSUB_RING_DEFER;
+                } else {
+                    config.recv_threads = -1;
                 }
                 break;
+            case 's':
+                config.shared_memory = 1;
+                break;
+            case 'g':
+                config.multicast = 1;
+                break;
+            case 'b':
+                config.replay_ms = (uint32_t)(atof(optarg) * 1000);
+                break;
+            default:
+                config.recv_threads = -1;
+                break;
         }
-        io_uring_cqe_seen(&ring, cqe);
-
-        free(req);
-
-        // printf("[SUB] Received message:\n%.*s\n", (int)0, buffer);
     }
-}
-
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <topic>\n", argv[0]);
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2 || config.recv_threads < 1) {
+        fprintf(stderr, "Usage: %s [-r receive threads] [-m sqpoll|defer] [-b replay seconds] [-s] [-g] <topic> [drop-newest|drop-oldest|block|disconnect] [lag bytes]\n", argv[0]);
         return 1;
     }
-    //generate unique system id
-    subscriber_id = generate_id();
-
-    //initalize topic array
-    subscribed_topics = malloc(TOPIC_CAPACITY * MAX_TOPIC_LEN);
-    subscribe_to_topic(argv[1]);
+    if (argc > 2) {
+        int p = 0;
+        while (p < BP_COUNT && strcmp(argv[2], bp_names[p]) != 0) {
+            p++;
+        }
+        if (p == BP_COUNT) {
+            fprintf(stderr, "Unknown backpressure policy %s\n", argv[2]);
+            return 1;
+        }
+        config.policy = p;
+    }
+    if (argc > 3) {
+        config.lag_limit = strtoul(argv[3], NULL, 10);
+    }
+    config.topic = argv[1];
 
-    //initialize uring
-    if(io_uring_queue_init(QUEUE_DEPTH, &ring, 0) < 0){
-        perror("io_uring failed");
+    if (mqsub_start(&config) < 0) {
         exit(EXIT_FAILURE);
     }
-    // set up TCP listen socket
-    int listen_fd = setup_listen_socket(&listen_port);
-
-    //const char *ip = argv[1];
-    //int port = atoi(argv[2]);
-    const char *topic = argv[1];
-
-    int hb_sock = setup_heartbeat();
-    pthread_t hb_thread;
-    pthread_create(&hb_thread, NULL, heartbeat_thread, &hb_sock);
     // accept input commands
     pthread_t inp_thread;
     pthread_create(&inp_thread, NULL, input_thread, NULL);
- 
-    receive_loop(listen_fd, topic);
+
+    mqsub_wait();
     puts("Subscriber exit");
     return 0;
-}
\ No newline at end of file
+}
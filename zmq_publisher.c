@@ -10,21 +10,134 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <stdatomic.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #define ENDPOINT "tcp://*:5556"
 #define MAX_LINE 1024
 #define MICROSERVICE_PORT 4444
+#define INGEST_BUFFERS 64 // microservice receive buffers, power of 2
+#define INGEST_BUFFER_SIZE 65536
 
 static _Atomic uint64_t pub_send_success = 0;
 static _Atomic uint64_t pub_send_eagain   = 0; 
 static _Atomic uint64_t pub_send_fail  = 0; 
+static _Atomic uint64_t pub_line_dropped = 0; //over-long lines skipped
 static _Atomic uint64_t sub_recv_success = 0;
 static _Atomic uint64_t sub_recv_eagain   = 0; 
 static _Atomic uint64_t sub_recv_fail  = 0; 
 
-char* microservice_message;
+// one microservice recv(), handed to the publishing loop by pointer
+typedef struct {
+    uint32_t len;
+    char data[INGEST_BUFFER_SIZE];
+} ingest_buf_t;
+
+// bounded lock-free MPMC ring (per-cell sequence numbers), used as
+// ingest -> publish loop hand-off and to return free buffers to ingest
+typedef struct {
+    _Atomic uint32_t seq;
+    ingest_buf_t *buf;
+} ingest_cell_t;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t enqueue_pos;
+    _Alignas(64) _Atomic uint32_t dequeue_pos;
+    ingest_cell_t cells[INGEST_BUFFERS];
+} ingest_ring_t;
+
 int microservice_fd = -1;
-int pipe_fds[2];    //used to write data from microservice thread to sending thread
+static ingest_ring_t ingest_ready;  //filled buffers, microservice thread -> publish loop
+static ingest_ring_t ingest_free;   //empty buffers back to the microservice thread
+static int ingest_event_fd = -1;    //wakes the publish loop when it is idle
+static _Atomic int router_sleeping;
+
+static void ingest_ring_init(ingest_ring_t *r) {
+    for (uint32_t i = 0; i < INGEST_BUFFERS; i++) {
+        atomic_init(&r->cells[i].seq, i);
+        r->cells[i].buf = NULL;
+    }
+    atomic_init(&r->enqueue_pos, 0);
+    atomic_init(&r->dequeue_pos, 0);
+}
+
+static int ingest_ring_push(ingest_ring_t *r, ingest_buf_t *buf) {
+    uint32_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    ingest_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & (INGEST_BUFFERS - 1)];
+        uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; //full
+        } else {
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->buf = buf;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+static ingest_buf_t *ingest_ring_pop(ingest_ring_t *r) {
+    uint32_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    ingest_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & (INGEST_BUFFERS - 1)];
+        uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL; //empty
+        } else {
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    ingest_buf_t *buf = cell->buf;
+    atomic_store_explicit(&cell->seq, pos + INGEST_BUFFERS, memory_order_release);
+    return buf;
+}
+
+// publish loop side. only sleeps (one eventfd read) when the ring is empty
+static ingest_buf_t *ingest_wait(void) {
+    ingest_buf_t *buf;
+    while (!(buf = ingest_ring_pop(&ingest_ready))) {
+        atomic_store(&router_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((buf = ingest_ring_pop(&ingest_ready))) {
+            atomic_store(&router_sleeping, 0);
+            break;
+        }
+        uint64_t count;
+        if (read(ingest_event_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            perror("ingest eventfd");
+        }
+        atomic_store(&router_sleeping, 0);
+    }
+    return buf;
+}
+
+// microservice side. only makes a syscall when the publish loop is asleep
+static void ingest_wake(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&router_sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(ingest_event_fd, &one, sizeof(one)) < 0) {
+            perror("ingest wake");
+        }
+    }
+}
 
 void* microservice_listener_thread(void* arg){
     //act as client - receive message from server
@@ -41,24 +154,29 @@ void* microservice_listener_thread(void* arg){
     int addrlen = sizeof(ms_addr);
 
     int conn = connect(sockfd, (struct sockaddr*) &ms_addr, sizeof(ms_addr));
-    char inbuf[1024];
     if(conn < 0){
         fprintf(stderr, "Thread failed to connect: %s\n",strerror(errno));
     }
     else {
-        if(pipe(pipe_fds) < 0){
-            fprintf(stderr,"Pipe failed: %s\n",strerror(errno));
-            exit(1);
-        }
         while(1){
-            int recvbytes = recv(sockfd, microservice_message, sizeof(inbuf), 0);
-            if(recvbytes < 0){
-                fprintf(stderr, "Thread failed to receive: %s\n",strerror(errno));
+            ingest_buf_t *buf;
+            while (!(buf = ingest_ring_pop(&ingest_free))) {
+                sched_yield(); //publish loop holds every buffer
             }
-            if(write(pipe_fds[1],microservice_message,strlen(microservice_message)) < 0){
-                fprintf(stderr, "Thread failed to write to ms fd: %s\n",strerror(errno));
+            int recvbytes = recv(sockfd, buf->data, sizeof(buf->data) - 1, 0);
+            if(recvbytes <= 0){
+                ingest_ring_push(&ingest_free, buf);
+                if(recvbytes < 0 && errno == EINTR){
+                    continue;
+                }
+                if(recvbytes < 0){
+                    fprintf(stderr, "Thread failed to receive: %s\n",strerror(errno));
+                }
+                break;
             }
-            memset(microservice_message, 0, 1024);
+            buf->len = recvbytes;
+            ingest_ring_push(&ingest_ready, buf);
+            ingest_wake();
         }
     }
     puts("microservice exit");
@@ -66,10 +184,44 @@ void* microservice_listener_thread(void* arg){
 }
 
 
+// send one "<topic> <message>" line as a topic frame and a payload frame
+static void publish_line(void *pub, char *line) {
+    // printf("Read data: %s\n",line);
+    char *topic = strtok(line, " ");
+    char *msg   = strtok(NULL, "\n");
+    if (!topic || !msg) {
+        // fprintf(stderr, "Usage: <topic> <message>\n");
+        return;
+    }
+    int rc;
+
+    // topic frame
+    rc = zmq_send(pub, topic, strlen(topic),
+                ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    if (rc >= 0) {
+        atomic_fetch_add(&pub_send_success, 1);
+    } else if (errno == EAGAIN) {
+        atomic_fetch_add(&pub_send_eagain, 1);
+    } else {
+        atomic_fetch_add(&pub_send_fail, 1);
+    }
+    // payload frame
+    rc = zmq_send(pub, msg, strlen(msg),
+                ZMQ_DONTWAIT);
+    if (rc >= 0) {
+        atomic_fetch_add(&pub_send_success, 1);
+    } else if (errno == EAGAIN) {
+        atomic_fetch_add(&pub_send_eagain, 1);
+    } else {
+        atomic_fetch_add(&pub_send_fail, 1);
+    }
+}
+
 void print_stats(){
     uint64_t send_success =atomic_load(&pub_send_success);
     uint64_t send = atomic_load(&pub_send_eagain);
     uint64_t send_fail = atomic_load(&pub_send_fail);
+    uint64_t dropped = atomic_load(&pub_line_dropped);
     uint64_t recv_success =atomic_load(&sub_recv_success);
     uint64_t recv = atomic_load(&sub_recv_eagain);
     uint64_t recv_fail = atomic_load(&sub_recv_fail);
@@ -77,12 +229,14 @@ void print_stats(){
       "PUB send success:  %lu\n"
       "PUB send not ready:  %lu\n"
       "PUB send other:  %lu\n"
+      "PUB lines dropped:  %lu\n"
       "SUB recv success: %lu\n"
       "SUB recv not ready: %lu\n"
       "SUB recv other: %lu\n",
       (unsigned long)send_success,
       (unsigned long)send,
       (unsigned long)send_fail,
+      (unsigned long)dropped,
       (unsigned long)recv_success,
       (unsigned long)recv,
       (unsigned long)recv_fail);
@@ -98,60 +252,71 @@ int main() {
     printf("ZeroMQ PUB bound at %s\n", ENDPOINT);
 
     pthread_t microservice_thread;
-    microservice_message = calloc(1024,1);
+    // ingest buffers all start out free
+    ingest_ring_init(&ingest_ready);
+    ingest_ring_init(&ingest_free);
+    ingest_event_fd = eventfd(0, 0);
+    if (ingest_event_fd < 0) {
+        perror("ingest eventfd");
+        return 1;
+    }
+    for (int i = 0; i < INGEST_BUFFERS; i++) {
+        ingest_buf_t *buf = malloc(sizeof(ingest_buf_t));
+        if (!buf) {
+            perror("malloc");
+            return 1;
+        }
+        ingest_ring_push(&ingest_free, buf);
+    }
     if (pthread_create(&microservice_thread, NULL, microservice_listener_thread, &microservice_fd) != 0) {
         perror("pthread_create");
-        free(microservice_message);
         return 1;
     }
     // puts("zmq about to loop");
     //publisher loop
+    char carry[MAX_LINE];   //line cut off by the end of the last recv
+    size_t carry_len = 0;
+    int overflow = 0;       //skipping an over-long line up to its newline
     while (1) {
-        char line[MAX_LINE];
-        memset(line, 0, sizeof(line));
-        if(pipe_fds[0] == STDIN_FILENO){
-            //try again to ensure that only messages from microservice are received
-            // puts("pipe fd 0");
-            if(pipe(pipe_fds) < 0){
-                fprintf(stderr,"Pipe failed: %s\n",strerror(errno));
-                exit(1);
+        // publish straight out of the microservice thread's buffer,
+        // one "<topic> <message>\n" line at a time
+        ingest_buf_t *buf = ingest_wait();
+        char *start = buf->data;
+        char *end = buf->data + buf->len;
+        char *nl;
+        while ((nl = memchr(start, '\n', end - start))) {
+            char *line = start;
+            *nl = '\0';
+            start = nl + 1;
+            if (overflow) {
+                overflow = 0; //end of the line we were skipping
+                continue;
             }
-            sleep(5);
-            continue;
-        }
-        if(read(pipe_fds[0],line,sizeof(line)) < 0){
-            fprintf(stderr, "Could not read from ms fd: %s\n",strerror(errno));
-            continue;
-        }
-        // printf("Read data: %s\n",line);
-        char *topic = strtok(line, " ");
-        char *msg   = strtok(NULL, "\n");
-        if (!topic || !msg) {
-            // fprintf(stderr, "Usage: <topic> <message>\n");
-            continue;
-        }
-        int rc;
-
-        // topic frame
-        rc = zmq_send(pub, topic, strlen(topic),
-                    ZMQ_SNDMORE | ZMQ_DONTWAIT);
-        if (rc >= 0) {
-            atomic_fetch_add(&pub_send_success, 1);
-        } else if (errno == EAGAIN) {
-            atomic_fetch_add(&pub_send_eagain, 1);
-        } else {
-            atomic_fetch_add(&pub_send_fail, 1);
+            if (carry_len) {
+                size_t len = nl - line + 1;
+                if (carry_len + len > sizeof(carry)) {
+                    carry_len = 0; //over-long line, drop all of it
+                    atomic_fetch_add(&pub_line_dropped, 1);
+                    continue;
+                }
+                memcpy(carry + carry_len, line, len);
+                line = carry;
+                carry_len = 0;
+            }
+            publish_line(pub, line);
         }
-        // payload frame
-        rc = zmq_send(pub, msg, strlen(msg),
-                    ZMQ_DONTWAIT);
-        if (rc >= 0) {
-            atomic_fetch_add(&pub_send_success, 1);
-        } else if (errno == EAGAIN) {
-            atomic_fetch_add(&pub_send_eagain, 1);
-        } else {
-            atomic_fetch_add(&pub_send_fail, 1);
+        size_t rest = end - start;
+        if (rest && !overflow) {
+            if (carry_len + rest < sizeof(carry)) {
+                memcpy(carry + carry_len, start, rest);
+                carry_len += rest;
+            } else {
+                carry_len = 0; //over-long line, skip it up to its newline
+                overflow = 1;
+                atomic_fetch_add(&pub_line_dropped, 1);
+            }
         }
+        ingest_ring_push(&ingest_free, buf);
     }
 
 